@@ -1,3 +1,6 @@
+/* prefix of all the messages */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
 #include <linux/version.h>
 #include <linux/init.h>
 #include <linux/module.h>
@@ -7,11 +10,45 @@
 #include <linux/vmalloc.h>
 #include <linux/mm.h>
 #include <linux/dma-mapping.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/uaccess.h>
+#include <linux/capability.h>
+#include <linux/device.h>
+#include <linux/huge_mm.h>
+#include <linux/cma.h>
+#include <linux/dma-map-ops.h>
+#include <linux/ktime.h>
+#include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/cpuhotplug.h>
+#include <linux/cpumask.h>
+#include <linux/dma-buf.h>
+#include <linux/scatterlist.h>
+#include <linux/uio.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/workqueue.h>
+#include <linux/string.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/splice.h>
+#include <linux/set_memory.h>
 #ifdef MODVERSIONS
 #  include <linux/modversions.h>
 #endif
 #include <asm/io.h>
 
+#include "mmap_alloc.h"
+#include "mmap_alloc_ring.h"
+#include "mmap_alloc_slab.h"
+
+#define CREATE_TRACE_POINTS
+#include "mmap_alloc_trace.h"
+
 /*
  * Example of driver that allows a user-space program to mmap a buffer of
  * contiguous non-cached physical memory.
@@ -24,159 +61,3005 @@
 /* character device structures */
 static dev_t mmap_dev;
 static struct cdev mmap_cdev;
+static struct class *mmap_class;
+/* device used for the DMA API */
+static struct device *mmap_device;
 
 /* methods of the character device */
 static int mmap_open(struct inode *inode, struct file *filp);
 static int mmap_release(struct inode *inode, struct file *filp);
 static int mmap_mmap(struct file *filp, struct vm_area_struct *vma);
+static long mmap_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static __poll_t mmap_poll(struct file *filp, poll_table *wait);
+static loff_t mmap_llseek(struct file *filp, loff_t offset, int whence);
+static ssize_t mmap_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t mmap_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static ssize_t mmap_splice_read(struct file *in, loff_t *ppos,
+				struct pipe_inode_info *pipe, size_t len,
+				unsigned int flags);
 
 /* the file operations, i.e. all character device methods */
 static struct file_operations mmap_fops = {
         .open = mmap_open,
         .release = mmap_release,
         .mmap = mmap_mmap,
+	.unlocked_ioctl = mmap_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.poll = mmap_poll,
+	.llseek = mmap_llseek,
+	.read_iter = mmap_read_iter,
+	.write_iter = mmap_write_iter,
+	.splice_read = mmap_splice_read,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	/* align the mappings of at least 2 MiB for the huge buffers */
+	.get_unmapped_area = thp_get_unmapped_area,
+#endif
         .owner = THIS_MODULE,
 };
 
-// length of the two memory areas
-#define NPAGES 16
-// pointer to the allocated area, rounded up to a page boundary
-static int *alloc_area;
-// original pointer for allocated area
-static void *alloc_ptr;
-dma_addr_t dma_handle;
+/* module parameters, readable from /sys/module/mmap_alloc/parameters/ */
+static unsigned long buf_size = 16 * PAGE_SIZE;
+module_param(buf_size, ulong, 0444);
+MODULE_PARM_DESC(buf_size, "Size in bytes of each buffer (rounded up to a page)");
 
-/* character device open method */
-static int mmap_open(struct inode *inode, struct file *filp)
+static unsigned int nr_bufs = 1;
+module_param(nr_bufs, uint, 0444);
+MODULE_PARM_DESC(nr_bufs, "Number of buffers to allocate");
+
+static bool private_bufs = true;
+module_param(private_bufs, bool, 0444);
+MODULE_PARM_DESC(private_bufs,
+    "Allocate the buffers at each open instead of sharing them (default: Y)");
+
+static int buf_node = NUMA_NO_NODE;
+module_param(buf_node, int, 0444);
+MODULE_PARM_DESC(buf_node,
+    "NUMA node of the buffers allocated at open or load time (default: any)");
+
+static bool pattern;
+module_param(pattern, bool, 0444);
+MODULE_PARM_DESC(pattern, "Store the test pattern checked by mmap_alloc_test "
+    "in the buffers allocated at open or load time (default: 0, zeroed)");
+
+static bool ring_bufs;
+module_param(ring_bufs, bool, 0444);
+MODULE_PARM_DESC(ring_bufs, "Lay out a ring (see mmap_alloc_ring.h) in the "
+    "buffers allocated at open or load time");
+
+static bool percpu_bufs;
+module_param(percpu_bufs, bool, 0444);
+MODULE_PARM_DESC(percpu_bufs, "Allocate a ring of buf_size bytes per CPU, "
+    "mapped at MMAP_ALLOC_PERCPU_OFFSET");
+
+static unsigned long pool_size;
+module_param(pool_size, ulong, 0444);
+MODULE_PARM_DESC(pool_size, "Size of the region reserved at load time for the "
+    "buffers allocated with MMAP_ALLOC_F_POOL, rounded up to a power of two "
+    "(default: 0, no pool)");
+
+static unsigned long recycle_max;
+module_param(recycle_max, ulong, 0444);
+MODULE_PARM_DESC(recycle_max, "Bytes of freed buffers kept, zeroed in the "
+    "background, to serve later allocations of the same size (default: 0, "
+    "disabled)");
+
+static bool async_init;
+module_param(async_init, bool, 0444);
+MODULE_PARM_DESC(async_init, "Register the device right away and allocate "
+    "the buffers, the pool and the per-CPU rings in the background");
+
+static bool use_cma = true;
+module_param(use_cma, bool, 0444);
+MODULE_PARM_DESC(use_cma, "Allocate from a CMA area first (default: Y)");
+
+static char *cma;
+module_param(cma, charp, 0444);
+MODULE_PARM_DESC(cma, "Name of the CMA area to use (default: the default "
+    "area reserved with cma= or in the device tree)");
+
+/* mmap offset layout, in pages (see mmap_alloc.h) */
+#define MMAP_PGOFF_ID_SHIFT	(MMAP_ALLOC_ID_SHIFT - PAGE_SHIFT)
+#define MMAP_PGOFF_MASK		((1UL << MMAP_PGOFF_ID_SHIFT) - 1)
+#define MMAP_ID_MASK		((1UL << MMAP_ALLOC_ID_BITS) - 1)
+#define MMAP_PGOFF_MODE_SHIFT	(MMAP_ALLOC_MODE_SHIFT - PAGE_SHIFT)
+#define MMAP_MODE_MASK		((1UL << MMAP_ALLOC_MODE_BITS) - 1)
+#define MMAP_PGOFF_LAZY		(MMAP_ALLOC_MAP_F_LAZY >> PAGE_SHIFT)
+#define MMAP_PGOFF_PREFAULT	(MMAP_ALLOC_MAP_F_PREFAULT >> PAGE_SHIFT)
+/* offset bits not assigned yet, must be zero */
+#define MMAP_PGOFF_RESERVED	((~0UL << (MMAP_PGOFF_MODE_SHIFT + \
+					   MMAP_ALLOC_MODE_BITS)) & \
+				 ~(MMAP_PGOFF_LAZY | MMAP_PGOFF_PREFAULT))
+
+/* pages mapped by a fault on a lazy mapping, as fault_around_bytes */
+#define MMAP_FAULT_AROUND_PAGES	16
+/* pages inserted by each vm_insert_pages() call of a prefaulted mapping */
+#define MMAP_PREFAULT_BATCH	512
+
+/*
+ * Kernel-side producer state of a ring. The header is mapped by user space,
+ * which could overwrite it, so the producer keeps its own copy of
+ * everything it has to trust and only reads tail from the header.
+ */
+struct mmap_ring {
+	struct mmap_buf *buf;
+	struct mmap_alloc_ring *hdr;
+	void *data;
+	u64 capacity;
+	u64 head;
+	u64 seq;
+};
+
+/*
+ * A physically contiguous buffer.
+ * Buffers are reference counted: each file that can see the buffer and each
+ * VMA mapping it hold a reference, so a buffer freed through the ioctl
+ * interface stays valid until it is unmapped.
+ */
+struct mmap_buf {
+	struct kref ref;
+	/* MMAP_ALLOC_F_* */
+	unsigned int flags;
+	/* MMAP_ALLOC_BACKEND_* */
+	unsigned int backend;
+	/* preferred NUMA node, or NUMA_NO_NODE */
+	int node;
+	/* size in bytes, multiple of PAGE_SIZE */
+	size_t size;
+	/* kernel virtual address of the area */
+	void *cpu_addr;
+	dma_addr_t dma_handle;
+	/* PMD and PTE entries installed by faults */
+	atomic_long_t huge_maps;
+	atomic_long_t page_maps;
+	/* mappings created with MMAP_ALLOC_MAP_F_PREFAULT and time spent */
+	atomic_long_t prefaults;
+	atomic64_t prefault_ns;
+	/* ring laid out in the buffer, if any */
+	struct mmap_ring *ring;
+	/* readers waiting in poll() for new data and count of publications */
+	wait_queue_head_t wait;
+	atomic64_t published;
+	/* eventfds signalled when data is produced, see struct mmap_doorbell */
+	spinlock_t doorbell_lock;
+	struct list_head doorbells;
+	/* with MMAP_ALLOC_F_POOL, first page of the block within the region */
+	unsigned long pool_index;
+	/* in the dirty or ready list once freed, with recycle_max */
+	struct list_head recycle_node;
+};
+
+/*
+ * An eventfd bound to a buffer by a file, signalled once the records or the
+ * bytes produced since the last signal reach a watermark. It is linked both
+ * to the buffer, under its doorbell_lock, and to the file, under its lock,
+ * and holds a reference to the buffer.
+ */
+struct mmap_doorbell {
+	struct list_head buf_node;
+	struct list_head file_node;
+	struct mmap_buf *buf;
+	struct eventfd_ctx *ctx;
+	/* watermarks, U64_MAX if disabled */
+	u64 records;
+	u64 bytes;
+	/* produced since the last signal */
+	u64 pending_records;
+	u64 pending_bytes;
+};
+
+/*
+ * Internal flag of mmap_buf: the memory must have struct pages, so that
+ * the buffer can be carved into smaller ones (see struct mmap_pool).
+ */
+#define MMAP_BUF_F_PAGES	(1U << 31)
+
+/*
+ * Allocation flag only: store the test pattern instead of zeroes, before the
+ * memory type of the kernel mapping is changed (see mmap_buf_fill_pattern()).
+ */
+#define MMAP_BUF_F_PATTERN	(1U << 30)
+
+/* a block of the pool, one for each page of the region */
+struct mmap_pool_block {
+	struct list_head node;
+	unsigned int order;
+	bool free;
+};
+
+/* orders of the blocks: from a page to the largest buffer */
+#define MMAP_POOL_ORDERS	(MMAP_ALLOC_ID_SHIFT - PAGE_SHIFT + 1)
+
+/*
+ * Buddy allocator carving the buffers allocated with MMAP_ALLOC_F_POOL out
+ * of a single region allocated at load time, so that small buffers are
+ * cheap to allocate and do not fragment physical memory. The blocks are
+ * described by the entry of their first page; a bitmap of the non-empty
+ * free lists finds the smallest fitting block in one search, which is then
+ * split at most max_order times, and freeing merges at most max_order
+ * buddies.
+ */
+struct mmap_pool {
+	/* the region, NULL without pool_size */
+	struct mmap_buf *region;
+	unsigned int max_order;
+	/* protects everything below */
+	spinlock_t lock;
+	/* bit n set if free_list[n] is not empty */
+	unsigned long avail;
+	struct list_head free_list[MMAP_POOL_ORDERS];
+	struct mmap_pool_block *blocks;
+	unsigned long free_pages;
+};
+
+static struct mmap_pool mmap_pool;
+
+/*
+ * Freed buffers kept for reuse: they are zeroed by a worker, moving them
+ * from the dirty to the ready list, so that they can be handed to another
+ * process without slowing down the allocations.
+ */
+static DEFINE_SPINLOCK(mmap_recycle_lock);
+static LIST_HEAD(mmap_recycle_dirty);
+static LIST_HEAD(mmap_recycle_ready);
+/* bytes in both lists */
+static unsigned long mmap_recycle_bytes;
+/* buffers in each list, buffers zeroed and reused so far */
+static unsigned long mmap_recycle_ndirty, mmap_recycle_nready;
+static atomic_long_t mmap_recycle_zeroed, mmap_recycle_reused;
+static void mmap_recycle_work_fn(struct work_struct *work);
+static DECLARE_WORK(mmap_recycle_work, mmap_recycle_work_fn);
+
+/* backends tried by mmap_buf_alloc(), in order of preference */
+static const unsigned int mmap_backends[] = {
+	MMAP_ALLOC_BACKEND_CMA,
+	MMAP_ALLOC_BACKEND_COHERENT,
+	MMAP_ALLOC_BACKEND_PAGES,
+};
+
+static const char * const mmap_backend_names[] = {
+	[MMAP_ALLOC_BACKEND_COHERENT] = "coherent",
+	[MMAP_ALLOC_BACKEND_CMA] = "cma",
+	[MMAP_ALLOC_BACKEND_PAGES] = "pages",
+};
+
+/* CMA area the buffers are allocated from, NULL if not available */
+static struct cma *mmap_cma;
+/* number of allocations served by a backend other than the first one */
+static atomic_long_t mmap_fallbacks;
+
+/* buffers shared by all the openers when private_bufs is not set */
+static struct mmap_buf **mmap_bufs;
+
+/*
+ * Statistics of the hot paths, per CPU so that updating them never bounces
+ * a cache line, summed up in debugfs (mmap_alloc/stats).
+ */
+#define MMAP_STATS_ERRNOS	64
+struct mmap_stats {
+	unsigned long opens;
+	unsigned long releases;
+	unsigned long mmaps;
+	/* VMAs opened and closed, and their bytes */
+	unsigned long vma_opens;
+	unsigned long vma_closes;
+	unsigned long mapped_bytes;
+	unsigned long unmapped_bytes;
+	unsigned long faults;
+	/* ns spent populating the mappings at mmap() time */
+	u64 remap_ns;
+	/* mmap() failures by errno, the last one for larger errnos */
+	unsigned long mmap_errors[MMAP_STATS_ERRNOS];
+};
+static DEFINE_PER_CPU(struct mmap_stats, mmap_stats);
+static struct dentry *mmap_debugfs;
+
+#define mmap_stat_inc(field)	this_cpu_inc(mmap_stats.field)
+#define mmap_stat_add(field, n)	this_cpu_add(mmap_stats.field, n)
+
+/*
+ * Allocation of the memory set up at load time: the pool, the shared
+ * buffers and the per-CPU rings. With async_init it runs on a workqueue
+ * and the openers wait for mmap_setup_done.
+ */
+static DECLARE_COMPLETION(mmap_setup_done);
+static int mmap_setup_ret;
+
+/*
+ * With percpu_bufs, the ring of each CPU. A slot is allocated when its CPU
+ * first comes up and kept until the module is unloaded, so that records
+ * left by a CPU going offline can still be consumed.
+ */
+static DEFINE_PER_CPU(struct mmap_buf *, mmap_percpu_buf);
+/* CPUs with a slot */
+static struct cpumask mmap_percpu_mask;
+/* dynamic CPU hotplug state allocating the slots */
+static int mmap_percpu_state;
+
+/* per-open state, hung off filp->private_data */
+struct mmap_file {
+	/* protects bufs */
+	struct mutex lock;
+	/* id -> struct mmap_buf, the id selects the buffer in the mmap offset */
+	struct idr bufs;
+	/* buffer watched by poll(), with a reference, and publications seen */
+	struct mmap_buf *watch;
+	u64 seen;
+	/* doorbells bound by this file */
+	struct list_head doorbells;
+};
+
+/*
+ * first page frame of a buffer backed by struct pages: the memory of the
+ * coherent backend may have none, and its dma_handle is a device address,
+ * so it is only ever mapped through dma_mmap_coherent()
+ */
+static unsigned long mmap_buf_pfn(struct mmap_buf *buf)
 {
-	printk(KERN_INFO "mmap_alloc: device open\n");
-        return 0;
+	return PFN_DOWN(virt_to_phys(buf->cpu_addr));
 }
-/* character device last close method */
-static int mmap_release(struct inode *inode, struct file *filp)
+
+/*
+ * map the pages of a buffer with the streaming DMA API; the cache lines are
+ * written back, so the memory can also be mapped non-cached
+ */
+static int mmap_buf_map(struct mmap_buf *buf)
 {
-	printk(KERN_INFO "mmap_alloc: device is being released\n");
-        return 0;
+	buf->dma_handle = dma_map_single(mmap_device, buf->cpu_addr,
+					 buf->size, DMA_BIDIRECTIONAL);
+	if (dma_mapping_error(mmap_device, buf->dma_handle)) {
+		pr_err_ratelimited("dma_map_single error\n");
+		return -ENOMEM;
+	}
+	return 0;
 }
 
-// helper function, mmap's the allocated area which is physically contiguous
-int mmap_kmem(struct file *filp, struct vm_area_struct *vma)
+/*
+ * give the kernel mapping of a non-cached buffer with struct pages the
+ * memory type of its user mappings: with PAT, x86 maps RAM with the type of
+ * the kernel alias whatever the VMA asks for, so the non-cached and
+ * write-combining mappings would silently be write-back
+ */
+static int mmap_buf_set_memtype(struct mmap_buf *buf)
 {
-        int ret;
-        long length = vma->vm_end - vma->vm_start;
+#ifdef CONFIG_X86
+	unsigned long addr = (unsigned long)buf->cpu_addr;
+	int npages = buf->size >> PAGE_SHIFT;
 
-        /* check length - do not allow larger mappings than the number of
-           pages allocated */
-        if (length > NPAGES * PAGE_SIZE)
-                return -EIO;
-/* #ifdef ARCH_HAS_DMA_MMAP_COHERENT */
-	if (vma->vm_pgoff == 0) {
-		printk(KERN_INFO "Using dma_mmap_coherent\n");
-		ret = dma_mmap_coherent(NULL, vma, alloc_ptr,
-					dma_handle, length);
-	} else
-/* #else */
-	{
-		printk(KERN_INFO "Using remap_pfn_range\n");
-		vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
-		vma->vm_flags |= VM_IO;
-		printk(KERN_INFO "off=%d\n", vma->vm_pgoff);
-	        ret = remap_pfn_range(vma, vma->vm_start,
-			      PFN_DOWN(virt_to_phys(bus_to_virt(dma_handle))) +
-			      vma->vm_pgoff, length, vma->vm_page_prot);
+	if (buf->flags & MMAP_ALLOC_F_CACHED)
+		return 0;
+	if (buf->flags & MMAP_ALLOC_F_WC)
+		return set_memory_wc(addr, npages);
+	return set_memory_uc(addr, npages);
+#else
+	return 0;
+#endif
+}
+
+/* restore the write-back type before the memory is freed */
+static void mmap_buf_clear_memtype(struct mmap_buf *buf)
+{
+#ifdef CONFIG_X86
+	if (!(buf->flags & MMAP_ALLOC_F_CACHED))
+		set_memory_wb((unsigned long)buf->cpu_addr,
+			      buf->size >> PAGE_SHIFT);
+#endif
+}
+
+/*
+ * whether the kernel mapping of a buffer is cached and has to be synced
+ * around the CPU accesses: on x86, the non-cached buffers with struct pages
+ * are UC- or WC in the kernel too (see mmap_buf_set_memtype())
+ */
+static bool mmap_buf_cached_alias(struct mmap_buf *buf)
+{
+	if (buf->backend == MMAP_ALLOC_BACKEND_COHERENT)
+		return false;
+	return !IS_ENABLED(CONFIG_X86) || (buf->flags & MMAP_ALLOC_F_CACHED);
+}
+
+/* NUMA node holding the memory of the buffer */
+static int mmap_buf_nid(struct mmap_buf *buf)
+{
+	/* the coherent memory may be remapped out of the linear map */
+	if (!virt_addr_valid(buf->cpu_addr))
+		return dev_to_node(mmap_device);
+	return page_to_nid(virt_to_page(buf->cpu_addr));
+}
+
+/*
+ * like alloc_pages_exact(), but on a given node: split the block and give
+ * back the pages beyond size, so free_pages_exact() can free the rest
+ */
+static void *mmap_alloc_pages_exact_node(int nid, size_t size, gfp_t gfp)
+{
+	unsigned int order = get_order(size);
+	unsigned long addr, used, end;
+	struct page *page;
+
+	page = alloc_pages_node(nid, gfp, order);
+	if (!page)
+		return NULL;
+	split_page(page, order);
+
+	addr = (unsigned long)page_address(page);
+	used = addr + PAGE_ALIGN(size);
+	end = addr + (PAGE_SIZE << order);
+	for (; used < end; used += PAGE_SIZE)
+		free_page(used);
+	return (void *)addr;
+}
+
+/* check whether a backend can be used for a buffer */
+static bool mmap_backend_usable(unsigned int backend, struct mmap_buf *buf)
+{
+	switch (backend) {
+	case MMAP_ALLOC_BACKEND_CMA:
+		return mmap_cma != NULL;
+	case MMAP_ALLOC_BACKEND_COHERENT:
+		/* cannot be mapped cached on non-coherent architectures, and
+		 * may have no struct pages to map at fault time */
+		if (buf->flags & (MMAP_ALLOC_F_CACHED | MMAP_ALLOC_F_WC |
+				  MMAP_ALLOC_F_HUGE | MMAP_BUF_F_PAGES))
+			return false;
+		/* dma_alloc_coherent() allocates on the node of the device */
+		return buf->node == NUMA_NO_NODE ||
+		       dev_to_node(mmap_device) == buf->node;
+	default:
+		return true;
 	}
-/* #endif */
-        /* map the whole physically contiguous area in one piece */
-        if (ret < 0) {
-		printk(KERN_ERR "mmap_alloc: remap failed (%d)\n", ret);
+}
+
+/*
+ * Store the test pattern in a buffer: the ints at even indices j hold
+ * 0xdead0000 + j and the following ones 0xbeef0000 + j, with the pairs
+ * written as single 64-bit stores. The buffers with struct pages are filled
+ * through their write-back kernel mapping, before mmap_buf_set_memtype():
+ * set_memory_uc() and set_memory_wc() flush the caches, and mmap_buf_map()
+ * writes back the lines of the cached buffers in one go.
+ */
+static void mmap_buf_fill_pattern(struct mmap_buf *buf)
+{
+	u64 *area = buf->cpu_addr;
+	size_t k, n = buf->size / sizeof(u64);
+	u32 lo, hi;
+
+	for (k = 0; k < n; k++) {
+		lo = 0xdead0000 + 2 * k;
+		hi = 0xbeef0000 + 2 * k;
+#ifdef __LITTLE_ENDIAN
+		area[k] = ((u64)hi << 32) | lo;
+#else
+		area[k] = ((u64)lo << 32) | hi;
+#endif
+		if (!(k % (SZ_1M / sizeof(u64))))
+			cond_resched();
+	}
+}
+
+/* allocate the memory of a buffer from the given backend */
+static int mmap_buf_alloc_backend(struct mmap_buf *buf, unsigned int backend)
+{
+	int ret;
+
+	buf->backend = backend;
+	switch (backend) {
+#ifdef CONFIG_DMA_CMA
+	case MMAP_ALLOC_BACKEND_CMA: {
+		struct page *page;
+
+		/* CMA keeps the huge buffers aligned to 2 MiB */
+		page = cma_alloc(mmap_cma, buf->size >> PAGE_SHIFT,
+				 (buf->flags & MMAP_ALLOC_F_HUGE) ?
+				 get_order(PMD_SIZE) : 0, true);
+		if (!page)
+			return -ENOMEM;
+		/* the area may span several nodes */
+		if (buf->node != NUMA_NO_NODE && page_to_nid(page) != buf->node) {
+			cma_release(mmap_cma, page, buf->size >> PAGE_SHIFT);
+			return -ENOMEM;
+		}
+		buf->cpu_addr = page_address(page);
+		if (buf->flags & MMAP_BUF_F_PATTERN)
+			mmap_buf_fill_pattern(buf);
+		else
+			memset(buf->cpu_addr, 0, buf->size);
+		ret = mmap_buf_set_memtype(buf);
+		if (ret == 0) {
+			ret = mmap_buf_map(buf);
+			if (ret == 0)
+				return 0;
+			mmap_buf_clear_memtype(buf);
+		}
+		cma_release(mmap_cma, page, buf->size >> PAGE_SHIFT);
 		return ret;
-        }
-        
-        return 0;
+	}
+#endif
+	case MMAP_ALLOC_BACKEND_COHERENT:
+		/* Allocate not-cached memory area with dma_map_coherent. */
+		buf->cpu_addr = dma_alloc_coherent(mmap_device, buf->size,
+						   &buf->dma_handle,
+						   GFP_KERNEL | __GFP_NOWARN);
+		if (!buf->cpu_addr)
+			return -ENOMEM;
+		if (buf->flags & MMAP_BUF_F_PATTERN)
+			mmap_buf_fill_pattern(buf);
+		return 0;
+	case MMAP_ALLOC_BACKEND_PAGES:
+		/* limited to the largest order of the page allocator */
+		buf->cpu_addr = mmap_alloc_pages_exact_node(buf->node,
+				buf->size, GFP_KERNEL | __GFP_ZERO |
+				__GFP_NOWARN);
+		if (!buf->cpu_addr)
+			return -ENOMEM;
+		if (buf->flags & MMAP_BUF_F_PATTERN)
+			mmap_buf_fill_pattern(buf);
+		ret = mmap_buf_set_memtype(buf);
+		if (ret == 0) {
+			ret = mmap_buf_map(buf);
+			if (ret == 0)
+				return 0;
+			mmap_buf_clear_memtype(buf);
+		}
+		free_pages_exact(buf->cpu_addr, buf->size);
+		return ret;
+	default:
+		return -EINVAL;
+	}
 }
 
-/* character device mmap method */
-static int mmap_mmap(struct file *filp, struct vm_area_struct *vma)
+/* allocate and initialize the descriptor of a buffer */
+static struct mmap_buf *mmap_buf_new(unsigned int flags, int node)
 {
-	printk(KERN_INFO "mmap_alloc: device is being mapped\n");
-        return mmap_kmem(filp, vma);
+	struct mmap_buf *buf;
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return NULL;
+	kref_init(&buf->ref);
+	init_waitqueue_head(&buf->wait);
+	spin_lock_init(&buf->doorbell_lock);
+	INIT_LIST_HEAD(&buf->doorbells);
+	buf->flags = flags;
+	buf->node = node;
+	return buf;
 }
 
-/* module initialization - called at module load time */
-static int __init mmap_alloc_init(void)
+/* take a zeroed buffer matching an allocation from the ready list */
+static struct mmap_buf *mmap_recycle_get(size_t size, unsigned int flags,
+					 int node)
 {
-        int ret = 0;
-        int i;
+	struct mmap_buf *buf;
 
-	/* Allocate not-cached memory area with dma_map_coherent. */
-	printk(KERN_INFO "Use dma_alloc_coherent\n");
-	alloc_ptr = dma_alloc_coherent (NULL, (NPAGES + 2) * PAGE_SIZE,
-					&dma_handle, GFP_KERNEL);
+	spin_lock(&mmap_recycle_lock);
+	list_for_each_entry(buf, &mmap_recycle_ready, recycle_node) {
+		if (buf->size == size && buf->flags == flags &&
+		    buf->node == node) {
+			list_del(&buf->recycle_node);
+			mmap_recycle_nready--;
+			mmap_recycle_bytes -= size;
+			spin_unlock(&mmap_recycle_lock);
 
-	if (!alloc_ptr) {
-                printk(KERN_ERR
-		    "mmap_alloc: dma_alloc_coherent error\n");
-                ret = -ENOMEM;
-                goto out;
-        }
-	printk(KERN_INFO "mmap_alloc: physical address is %lu\n",
-	    dma_handle);
-	printk(KERN_INFO "mmap_alloc: bus_to_virt %lu\n",
-	    virt_to_phys(bus_to_virt(dma_handle)));
+			/* as left by mmap_buf_new() */
+			kref_init(&buf->ref);
+			atomic_long_set(&buf->huge_maps, 0);
+			atomic_long_set(&buf->page_maps, 0);
+			atomic_long_set(&buf->prefaults, 0);
+			atomic64_set(&buf->prefault_ns, 0);
+			atomic64_set(&buf->published, 0);
+			atomic_long_inc(&mmap_recycle_reused);
+			return buf;
+		}
+	}
+	spin_unlock(&mmap_recycle_lock);
+	return NULL;
+}
 
-	alloc_area = alloc_ptr;
+/*
+ * allocate a zeroed buffer (or one holding the test pattern with
+ * MMAP_BUF_F_PATTERN) of size bytes, preferably on the given node
+ */
+static struct mmap_buf *mmap_buf_alloc(size_t size, unsigned int flags,
+				       int node)
+{
+	struct mmap_buf *buf;
+	unsigned int i, tried = 0;
 
-        /* get the major number of the character device */
-        if ((ret = alloc_chrdev_region(&mmap_dev, 0, 1, "mmap_alloc")) < 0) {
-                printk(KERN_ERR
-		    "mmap_alloc: could not allocate major number for mmap\n");
-                goto out_vfree;
-        }
+	size = (flags & MMAP_ALLOC_F_HUGE) ? ALIGN(size, PMD_SIZE) :
+	       PAGE_ALIGN(size);
+	/* the recycled buffers are zeroed */
+	if (recycle_max && !(flags & MMAP_BUF_F_PATTERN)) {
+		buf = mmap_recycle_get(size, flags, node);
+		if (buf)
+			return buf;
+	}
 
-        /* initialize the device structure and register the device with the
-	 * kernel */
-        cdev_init(&mmap_cdev, &mmap_fops);
-        if ((ret = cdev_add(&mmap_cdev, mmap_dev, 1)) < 0) {
-                printk(KERN_ERR
-		    "mmap_alloc: could not allocate chrdev for mmap\n");
-                goto out_unalloc_region;
-        }
+	buf = mmap_buf_new(flags, node);
+	if (!buf)
+		return NULL;
+	buf->size = size;
 
-	/* store a pattern in the memory.
-	 * the test application will check for it */
-        for (i = 0; i < (NPAGES * PAGE_SIZE / sizeof(int)); i += 2) {
-                alloc_area[i] = (0xdead << 16) + i;
-                alloc_area[i + 1] = (0xbeef << 16) + i;
-        }
-        
-        return ret;
-        
-  out_unalloc_region:
-        unregister_chrdev_region(mmap_dev, 1);
-  out_vfree:
-	dma_free_coherent (NULL, (NPAGES + 2) * PAGE_SIZE, alloc_ptr,
-	    dma_handle);
-  out:
-        return ret;
+	for (i = 0; i < ARRAY_SIZE(mmap_backends); i++) {
+		if (!mmap_backend_usable(mmap_backends[i], buf))
+			continue;
+		if (mmap_buf_alloc_backend(buf, mmap_backends[i]) == 0)
+			break;
+		pr_debug("%s allocation of %zu bytes failed\n",
+			 mmap_backend_names[mmap_backends[i]], buf->size);
+		tried++;
+	}
+	if (i == ARRAY_SIZE(mmap_backends)) {
+		pr_err_ratelimited("cannot allocate %zu bytes\n", buf->size);
+		kfree(buf);
+		return NULL;
+	}
+	if (tried)
+		atomic_long_inc(&mmap_fallbacks);
+	/* the buffer is recycled (zeroed) like any other */
+	buf->flags &= ~MMAP_BUF_F_PATTERN;
+
+	pr_debug("buffer physical address is %pad (%s, node %d)\n",
+		 &buf->dma_handle, mmap_backend_names[buf->backend],
+		 mmap_buf_nid(buf));
+	if ((flags & MMAP_ALLOC_F_HUGE) &&
+	    !IS_ALIGNED(PFN_PHYS(mmap_buf_pfn(buf)), PMD_SIZE))
+		pr_debug("huge buffer not aligned to %lu bytes, its mappings "
+			 "will be partly huge\n", (unsigned long)PMD_SIZE);
+	return buf;
 }
 
-/* module unload */
-static void __exit mmap_alloc_exit(void)
+/* put a block on its free list, the pool must be locked */
+static void mmap_pool_add(unsigned long index, unsigned int order)
 {
-        int i;
+	struct mmap_pool_block *blk = &mmap_pool.blocks[index];
 
-        /* remove the character deivce */
-        cdev_del(&mmap_cdev);
-        unregister_chrdev_region(mmap_dev, 1);
+	blk->order = order;
+	blk->free = true;
+	list_add(&blk->node, &mmap_pool.free_list[order]);
+	__set_bit(order, &mmap_pool.avail);
+}
 
-	/* free the memory areas */
-	dma_free_coherent (NULL, (NPAGES + 2) * PAGE_SIZE, alloc_ptr,
-	    dma_handle);
+/* take a block off its free list, the pool must be locked */
+static void mmap_pool_del(struct mmap_pool_block *blk)
+{
+	blk->free = false;
+	list_del(&blk->node);
+	if (list_empty(&mmap_pool.free_list[blk->order]))
+		__clear_bit(blk->order, &mmap_pool.avail);
 }
 
-module_init(mmap_alloc_init);
-module_exit(mmap_alloc_exit);
-MODULE_DESCRIPTION("mmap_alloc driver");
-MODULE_AUTHOR("Claudio Scordino and Bruno Morelli");
-MODULE_LICENSE("GPL");
+/*
+ * allocate a block of 2^order pages, splitting a larger one if needed;
+ * returns the index of its first page or -ENOMEM
+ */
+static long mmap_pool_alloc_block(unsigned int order)
+{
+	struct mmap_pool_block *blk;
+	unsigned long index;
+	unsigned int n;
+
+	spin_lock(&mmap_pool.lock);
+	n = find_next_bit(&mmap_pool.avail, MMAP_POOL_ORDERS, order);
+	if (n >= MMAP_POOL_ORDERS) {
+		spin_unlock(&mmap_pool.lock);
+		return -ENOMEM;
+	}
+	blk = list_first_entry(&mmap_pool.free_list[n],
+			       struct mmap_pool_block, node);
+	mmap_pool_del(blk);
+	index = blk - mmap_pool.blocks;
+	/* give back the upper halves */
+	while (n > order) {
+		n--;
+		mmap_pool_add(index + (1UL << n), n);
+	}
+	blk->order = order;
+	mmap_pool.free_pages -= 1UL << order;
+	spin_unlock(&mmap_pool.lock);
+	return index;
+}
+
+/* free a block, merging it with its free buddies */
+static void mmap_pool_free_block(unsigned long index, unsigned int order)
+{
+	struct mmap_pool_block *buddy;
+
+	spin_lock(&mmap_pool.lock);
+	mmap_pool.free_pages += 1UL << order;
+	while (order < mmap_pool.max_order) {
+		buddy = &mmap_pool.blocks[index ^ (1UL << order)];
+		if (!buddy->free || buddy->order != order)
+			break;
+		mmap_pool_del(buddy);
+		index &= ~(1UL << order);
+		order++;
+	}
+	mmap_pool_add(index, order);
+	spin_unlock(&mmap_pool.lock);
+}
+
+static void mmap_buf_release(struct kref *ref);
+
+/* give the memory of a buffer back */
+static void mmap_buf_free(struct mmap_buf *buf)
+{
+	if (buf->flags & MMAP_ALLOC_F_POOL) {
+		/* the memory goes back to the pool, which holds the region */
+		mmap_pool_free_block(buf->pool_index,
+				     ilog2(buf->size >> PAGE_SHIFT));
+		kref_put(&mmap_pool.region->ref, mmap_buf_release);
+	} else if (buf->backend == MMAP_ALLOC_BACKEND_COHERENT) {
+		dma_free_coherent(mmap_device, buf->size, buf->cpu_addr,
+				  buf->dma_handle);
+	} else {
+		dma_unmap_single(mmap_device, buf->dma_handle, buf->size,
+				 DMA_BIDIRECTIONAL);
+		mmap_buf_clear_memtype(buf);
+#ifdef CONFIG_DMA_CMA
+		if (buf->backend == MMAP_ALLOC_BACKEND_CMA)
+			cma_release(mmap_cma, virt_to_page(buf->cpu_addr),
+				    buf->size >> PAGE_SHIFT);
+		else
+#endif
+			free_pages_exact(buf->cpu_addr, buf->size);
+	}
+	kfree(buf);
+}
+
+/* zero the memory of a buffer, bypassing the caches where possible */
+static void mmap_buf_zero(struct mmap_buf *buf)
+{
+	size_t off;
+
+	/*
+	 * the stores through a UC- or WC kernel alias (and through the
+	 * coherent one, if not cached) already bypass the caches
+	 */
+	if (!mmap_buf_cached_alias(buf)) {
+		memset(buf->cpu_addr, 0, buf->size);
+		return;
+	}
+	/*
+	 * through a write-back alias, memcpy_flushcache() uses non-temporal
+	 * stores where the CPU has them (and writes back the lines otherwise),
+	 * so the zeroes do not evict the working set of the CPU
+	 */
+	for (off = 0; off < buf->size; off += PAGE_SIZE) {
+		memcpy_flushcache(buf->cpu_addr + off,
+				  page_address(ZERO_PAGE(0)), PAGE_SIZE);
+		cond_resched();
+	}
+	dma_sync_single_for_device(mmap_device, buf->dma_handle, buf->size,
+				   DMA_BIDIRECTIONAL);
+}
+
+/* zero the dirty buffers and move them to the ready list */
+static void mmap_recycle_work_fn(struct work_struct *work)
+{
+	struct mmap_buf *buf;
+
+	for (;;) {
+		spin_lock(&mmap_recycle_lock);
+		buf = list_first_entry_or_null(&mmap_recycle_dirty,
+					       struct mmap_buf, recycle_node);
+		if (buf) {
+			list_del(&buf->recycle_node);
+			mmap_recycle_ndirty--;
+		}
+		spin_unlock(&mmap_recycle_lock);
+		if (!buf)
+			break;
+
+		mmap_buf_zero(buf);
+		atomic_long_inc(&mmap_recycle_zeroed);
+
+		spin_lock(&mmap_recycle_lock);
+		list_add(&buf->recycle_node, &mmap_recycle_ready);
+		mmap_recycle_nready++;
+		spin_unlock(&mmap_recycle_lock);
+	}
+}
+
+/*
+ * whether a page of the buffer is still referenced outside the driver, e.g.
+ * pinned by get_user_pages() for a DMA that outlived the mappings: the
+ * memory must then go back to the page allocator, not to another user
+ */
+static bool mmap_buf_pages_busy(struct mmap_buf *buf)
+{
+	struct page *page = virt_to_page(buf->cpu_addr);
+	unsigned long i;
+
+	for (i = 0; i < buf->size >> PAGE_SHIFT; i++, page++) {
+		if (page_count(page) != 1)
+			return true;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+		if (folio_maybe_dma_pinned(page_folio(page)))
+#else
+		if (page_maybe_dma_pinned(page))
+#endif
+			return true;
+	}
+	return false;
+}
+
+/*
+ * keep a freed buffer for reuse if it fits within recycle_max; returns
+ * false if it has to be freed
+ */
+static bool mmap_recycle_put(struct mmap_buf *buf)
+{
+	/* the memory of pool buffers and of the pool belongs to the pool */
+	if (buf->flags & (MMAP_ALLOC_F_POOL | MMAP_BUF_F_PAGES))
+		return false;
+	/*
+	 * the coherent memory is only mapped with VM_PFNMAP and cannot be
+	 * pinned, but its pages (if any) are not refcounted one by one
+	 */
+	if (buf->backend != MMAP_ALLOC_BACKEND_COHERENT &&
+	    mmap_buf_pages_busy(buf))
+		return false;
+
+	spin_lock(&mmap_recycle_lock);
+	if (mmap_recycle_bytes + buf->size > recycle_max) {
+		spin_unlock(&mmap_recycle_lock);
+		return false;
+	}
+	mmap_recycle_bytes += buf->size;
+	list_add_tail(&buf->recycle_node, &mmap_recycle_dirty);
+	mmap_recycle_ndirty++;
+	spin_unlock(&mmap_recycle_lock);
+
+	queue_work(system_unbound_wq, &mmap_recycle_work);
+	return true;
+}
+
+/* free all the buffers kept for reuse */
+static void mmap_recycle_cleanup(void)
+{
+	struct mmap_buf *buf, *tmp;
+
+	cancel_work_sync(&mmap_recycle_work);
+	list_splice_init(&mmap_recycle_dirty, &mmap_recycle_ready);
+	list_for_each_entry_safe(buf, tmp, &mmap_recycle_ready, recycle_node)
+		mmap_buf_free(buf);
+	INIT_LIST_HEAD(&mmap_recycle_ready);
+	mmap_recycle_bytes = 0;
+	mmap_recycle_ndirty = 0;
+	mmap_recycle_nready = 0;
+}
+
+static void mmap_buf_release(struct kref *ref)
+{
+	struct mmap_buf *buf = container_of(ref, struct mmap_buf, ref);
+
+	kfree(buf->ring);
+	buf->ring = NULL;
+	if (recycle_max && mmap_recycle_put(buf))
+		return;
+	mmap_buf_free(buf);
+}
+
+static inline void mmap_buf_get(struct mmap_buf *buf)
+{
+	kref_get(&buf->ref);
+}
+
+static inline void mmap_buf_put(struct mmap_buf *buf)
+{
+	kref_put(&buf->ref, mmap_buf_release);
+}
+
+/*
+ * Wake up the readers polling the buffer. The new data must have been
+ * stored before: the barrier in wq_has_sleeper() pairs with the one in
+ * mmap_poll(), so either the reader sees the data or we see the reader.
+ */
+static void mmap_buf_wake(struct mmap_buf *buf)
+{
+	if (wq_has_sleeper(&buf->wait))
+		wake_up_interruptible_poll(&buf->wait, EPOLLIN | EPOLLRDNORM);
+}
+
+static inline void mmap_eventfd_signal(struct eventfd_ctx *ctx)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+	eventfd_signal(ctx);
+#else
+	eventfd_signal(ctx, 1);
+#endif
+}
+
+/*
+ * Account records for a total of bytes bytes to the doorbells of the buffer
+ * and signal the ones reaching a watermark. Can be called from any context.
+ */
+static void mmap_buf_ring_doorbells(struct mmap_buf *buf, u64 records,
+				    u64 bytes)
+{
+	struct mmap_doorbell *db;
+	unsigned long flags;
+
+	if (list_empty_careful(&buf->doorbells))
+		return;
+
+	spin_lock_irqsave(&buf->doorbell_lock, flags);
+	list_for_each_entry(db, &buf->doorbells, buf_node) {
+		db->pending_records += records;
+		db->pending_bytes += bytes;
+		if (db->pending_records < db->records &&
+		    db->pending_bytes < db->bytes)
+			continue;
+		db->pending_records = 0;
+		db->pending_bytes = 0;
+		mmap_eventfd_signal(db->ctx);
+	}
+	spin_unlock_irqrestore(&buf->doorbell_lock, flags);
+}
+
+/* allocate a zeroed buffer of at least size bytes from the pool */
+static struct mmap_buf *mmap_pool_alloc(size_t size)
+{
+	struct mmap_buf *region = mmap_pool.region;
+	struct mmap_buf *buf;
+	unsigned int order = get_order(size);
+	long index;
+
+	if (!region || order > mmap_pool.max_order)
+		return NULL;
+	buf = mmap_buf_new(MMAP_ALLOC_F_POOL, region->node);
+	if (!buf)
+		return NULL;
+	index = mmap_pool_alloc_block(order);
+	if (index < 0) {
+		kfree(buf);
+		return NULL;
+	}
+	buf->backend = region->backend;
+	buf->size = PAGE_SIZE << order;
+	buf->pool_index = index;
+	buf->cpu_addr = region->cpu_addr + (index << PAGE_SHIFT);
+	buf->dma_handle = region->dma_handle + (index << PAGE_SHIFT);
+	mmap_buf_get(region);
+
+	/* the block may hold data of a previous buffer */
+	memset(buf->cpu_addr, 0, buf->size);
+	dma_sync_single_range_for_device(mmap_device, region->dma_handle,
+					 index << PAGE_SHIFT, buf->size,
+					 DMA_BIDIRECTIONAL);
+	return buf;
+}
+
+/* lay out an empty ring in the buffer */
+static int mmap_buf_init_ring(struct mmap_buf *buf)
+{
+	struct mmap_alloc_ring *hdr = buf->cpu_addr;
+	struct mmap_ring *ring;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+	ring->buf = buf;
+	ring->hdr = hdr;
+	ring->data = hdr + 1;
+	ring->capacity = (buf->size - sizeof(*hdr)) & ~7ULL;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->version = MMAP_ALLOC_RING_VERSION;
+	hdr->capacity = ring->capacity;
+	hdr->data_offset = sizeof(*hdr);
+	/* publish the magic last, the header is complete when it is seen */
+	smp_store_release(&hdr->magic, MMAP_ALLOC_RING_MAGIC);
+
+	buf->ring = ring;
+	return 0;
+}
+
+/*
+ * Get the ring of the buffer with the given index among the ones allocated
+ * at load time. Only available with ring_bufs=1 and private_bufs=0.
+ */
+struct mmap_ring *mmap_alloc_ring_get(unsigned int index)
+{
+	struct mmap_buf **bufs;
+
+	if (private_bufs || !ring_bufs || index >= nr_bufs)
+		return NULL;
+	/* NULL until allocated, with async_init */
+	bufs = smp_load_acquire(&mmap_bufs);
+	return bufs ? bufs[index]->ring : NULL;
+}
+EXPORT_SYMBOL_GPL(mmap_alloc_ring_get);
+
+/*
+ * Append a record with len bytes of payload to the ring.
+ * There must be a single producer per ring: callers have to serialize the
+ * calls on the same ring. Never sleeps, so it can be called from any
+ * context. The readers polling the buffer are woken up and the doorbells
+ * bound to it are signalled as their watermarks are reached.
+ * Returns -ENOSPC if the consumer has not freed enough space, -EMSGSIZE if
+ * the record can never fit, -EIO if user space corrupted the header.
+ */
+int mmap_alloc_ring_enqueue(struct mmap_ring *ring, const void *data, u32 len)
+{
+	struct mmap_alloc_ring *hdr = ring->hdr;
+	struct mmap_alloc_ring_rec *rec;
+	u64 need = MMAP_ALLOC_RING_REC_SIZE(len);
+	u64 head = ring->head;
+	u64 pos = head % ring->capacity;
+	u64 pad = 0, tail;
+
+	if (need > ring->capacity)
+		return -EMSGSIZE;
+	/* records do not wrap: pad the end of the data area */
+	if (ring->capacity - pos < need)
+		pad = ring->capacity - pos;
+
+	/* pairs with the release store of tail by the consumer, so that the
+	 * space is not overwritten while it is still being read */
+	tail = smp_load_acquire(&hdr->tail);
+	if (tail > head || head - tail > ring->capacity)
+		return -EIO;
+	if (ring->capacity - (head - tail) < pad + need)
+		return -ENOSPC;
+
+	if (pad) {
+		rec = ring->data + pos;
+		rec->len = 0;
+		rec->flags = MMAP_ALLOC_RING_REC_PAD;
+		head += pad;
+		pos = 0;
+	}
+	rec = ring->data + pos;
+	rec->len = len;
+	rec->flags = 0;
+	memcpy(rec + 1, data, len);
+	head += need;
+
+	WRITE_ONCE(ring->head, head);
+	WRITE_ONCE(hdr->seq, ++ring->seq);
+	/* the record must be visible before the new head */
+	smp_store_release(&hdr->head, head);
+	mmap_buf_wake(ring->buf);
+	mmap_buf_ring_doorbells(ring->buf, 1, need);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(mmap_alloc_ring_enqueue);
+
+/*
+ * Append a record to the ring of the current CPU (see percpu_bufs).
+ * Producers on different CPUs never share a ring, so no atomic operation
+ * is needed: interrupts are only disabled to serialize with the producers
+ * running in interrupt context on the same CPU. Not for NMI context.
+ * Returns -ENODEV if the CPU has no ring, otherwise as
+ * mmap_alloc_ring_enqueue().
+ */
+int mmap_alloc_percpu_enqueue(const void *data, u32 len)
+{
+	struct mmap_buf *buf;
+	unsigned long flags;
+	int ret;
+
+	local_irq_save(flags);
+	buf = this_cpu_read(mmap_percpu_buf);
+	ret = buf ? mmap_alloc_ring_enqueue(buf->ring, data, len) : -ENODEV;
+	local_irq_restore(flags);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(mmap_alloc_percpu_enqueue);
+
+/*
+ * allocate a buffer of buf_size bytes, zeroed or holding the test pattern,
+ * or a ring with ring_bufs=1
+ */
+static struct mmap_buf *mmap_alloc_default_buf(void)
+{
+	struct mmap_buf *buf;
+
+	/* the ring is shared between CPUs only, so it can be cached; the test
+	 * application checks for the pattern */
+	buf = mmap_buf_alloc(buf_size, ring_bufs ? MMAP_ALLOC_F_CACHED :
+			     pattern ? MMAP_BUF_F_PATTERN : 0, buf_node);
+	if (!buf)
+		return NULL;
+
+	if (ring_bufs && mmap_buf_init_ring(buf) < 0) {
+		mmap_buf_put(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/* drop the references to the first n buffers of an array */
+static void mmap_put_bufs(struct mmap_buf **bufs, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		mmap_buf_put(bufs[i]);
+	kfree(bufs);
+}
+
+/* look up a buffer of the file and take a reference to it */
+static struct mmap_buf *mmap_file_get_buf(struct mmap_file *mf,
+					  unsigned long id)
+{
+	struct mmap_buf *buf;
+
+	mutex_lock(&mf->lock);
+	buf = idr_find(&mf->bufs, id);
+	if (buf)
+		mmap_buf_get(buf);
+	mutex_unlock(&mf->lock);
+	return buf;
+}
+
+/*
+ * give a new buffer an id in the file; on failure the reference to the
+ * buffer is dropped
+ */
+static int mmap_file_add_buf(struct mmap_file *mf, struct mmap_buf *buf)
+{
+	int id;
+
+	mutex_lock(&mf->lock);
+	/* the last id is reserved for the per-CPU rings */
+	id = idr_alloc(&mf->bufs, buf, 0, MMAP_ALLOC_PERCPU_ID, GFP_KERNEL);
+	mutex_unlock(&mf->lock);
+	if (id < 0)
+		mmap_buf_put(buf);
+	return id;
+}
+
+/* undo mmap_file_add_buf() */
+static void mmap_file_remove_buf(struct mmap_file *mf, int id)
+{
+	struct mmap_buf *buf;
+
+	mutex_lock(&mf->lock);
+	buf = idr_remove(&mf->bufs, id);
+	mutex_unlock(&mf->lock);
+	mmap_buf_put(buf);
+}
+
+/*
+ * Private data of a VMA: the buffer it holds a reference to (none for the
+ * per-CPU rings) and the bytes counted in mapped_bytes when it was mapped
+ * or opened. A VMA shrinks without notice when it is split by a partial
+ * munmap() or mprotect(), while the new part is opened with its own length,
+ * so the length counted at the start is the one to count back at close.
+ */
+struct mmap_vma {
+	struct mmap_buf *buf;
+	unsigned long bytes;
+};
+
+static struct mmap_vma *mmap_vma_alloc(struct mmap_buf *buf,
+				       unsigned long bytes, gfp_t gfp)
+{
+	struct mmap_vma *mv;
+
+	mv = kmalloc(sizeof(*mv), gfp);
+	if (mv) {
+		mv->buf = buf;
+		mv->bytes = bytes;
+	}
+	return mv;
+}
+
+static inline struct mmap_buf *mmap_vma_buf(struct vm_area_struct *vma)
+{
+	struct mmap_vma *mv = vma->vm_private_data;
+
+	return mv->buf;
+}
+
+static void mmap_stats_vma_open(struct vm_area_struct *vma)
+{
+	struct mmap_vma *mv = vma->vm_private_data;
+
+	mmap_stat_inc(vma_opens);
+	mmap_stat_add(mapped_bytes, mv->bytes);
+}
+
+static void mmap_stats_vma_close(struct vm_area_struct *vma)
+{
+	struct mmap_vma *mv = vma->vm_private_data;
+
+	mmap_stat_inc(vma_closes);
+	mmap_stat_add(unmapped_bytes, mv->bytes);
+}
+
+/*
+ * a VMA copied by fork() or split off another one: it shares the private
+ * data of the original until it gets its own, which cannot fail here
+ */
+static void mmap_vma_open(struct vm_area_struct *vma)
+{
+	struct mmap_vma *orig = vma->vm_private_data;
+
+	vma->vm_private_data = mmap_vma_alloc(orig->buf,
+					      vma->vm_end - vma->vm_start,
+					      GFP_KERNEL | __GFP_NOFAIL);
+	mmap_stats_vma_open(vma);
+	if (orig->buf)
+		mmap_buf_get(orig->buf);
+}
+
+static void mmap_vma_close(struct vm_area_struct *vma)
+{
+	struct mmap_vma *mv = vma->vm_private_data;
+
+	mmap_stats_vma_close(vma);
+	if (mv->buf)
+		mmap_buf_put(mv->buf);
+	kfree(mv);
+}
+
+static const struct vm_operations_struct mmap_vm_ops = {
+	.open = mmap_vma_open,
+	.close = mmap_vma_close,
+};
+
+static inline void mmap_vma_set_flags(struct vm_area_struct *vma,
+				      vm_flags_t flags)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_set(vma, flags);
+#else
+	vma->vm_flags |= flags;
+#endif
+}
+
+/* the faults are only timed while their tracepoint is enabled */
+static inline u64 mmap_fault_start(void)
+{
+	return trace_mmap_alloc_fault_enabled() ? ktime_get_ns() : 0;
+}
+
+static inline vm_fault_t mmap_fault_end(struct vm_fault *vmf,
+					unsigned int order, vm_fault_t ret,
+					u64 t0)
+{
+	if (t0)
+		trace_mmap_alloc_fault(vmf->address,
+				       vmf->pgoff & MMAP_PGOFF_MASK, order,
+				       ret, ktime_get_ns() - t0);
+	return ret;
+}
+
+/*
+ * map the page of the buffer that contains the faulting address, then fault
+ * around it: map the rest of the aligned block of MMAP_FAULT_AROUND_PAGES
+ * pages, so that a sequential scan takes one fault per block.
+ * This is done here rather than in a .map_pages method, because that one is
+ * called under rcu_read_lock() while vmf_insert_pfn() may need to allocate
+ * a page table.
+ */
+static vm_fault_t mmap_vm_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct mmap_buf *buf = mmap_vma_buf(vma);
+	unsigned long off = vmf->pgoff & MMAP_PGOFF_MASK;
+	unsigned long npages = buf->size >> PAGE_SHIFT;
+	unsigned long pfn = mmap_buf_pfn(buf) + off;
+	unsigned long base = vmf->address & PAGE_MASK;
+	unsigned long addr, start, end;
+	u64 t0 = mmap_fault_start();
+	vm_fault_t ret;
+
+	mmap_stat_inc(faults);
+
+	if (off >= npages)
+		return mmap_fault_end(vmf, 0, VM_FAULT_SIGBUS, t0);
+	ret = vmf_insert_pfn(vma, base, pfn);
+	if (ret != VM_FAULT_NOPAGE)
+		return mmap_fault_end(vmf, 0, ret, t0);
+	atomic_long_inc(&buf->page_maps);
+
+	start = max(ALIGN_DOWN(base, MMAP_FAULT_AROUND_PAGES * PAGE_SIZE),
+		    vma->vm_start);
+	end = min(ALIGN(base + 1, MMAP_FAULT_AROUND_PAGES * PAGE_SIZE),
+		  vma->vm_end);
+	/* do not go past the end of the buffer */
+	end = min(end, base + ((npages - off) << PAGE_SHIFT));
+	for (addr = start; addr < end; addr += PAGE_SIZE) {
+		if (addr == base)
+			continue;
+		if (vmf_insert_pfn(vma, addr, pfn + (addr >> PAGE_SHIFT) -
+				   (base >> PAGE_SHIFT)) != VM_FAULT_NOPAGE)
+			break;
+		atomic_long_inc(&buf->page_maps);
+	}
+	return mmap_fault_end(vmf, 0, ret, t0);
+}
+
+#ifdef CONFIG_ARCH_SUPPORTS_PMD_PFNMAP
+/*
+ * map the 2 MiB of the buffer around the faulting address with a single PMD
+ * entry, if both the virtual and the physical ranges are aligned
+ */
+static vm_fault_t mmap_vm_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct mmap_buf *buf = mmap_vma_buf(vma);
+	unsigned long addr = vmf->address & PMD_MASK;
+	unsigned long off, pfn;
+	u64 t0 = mmap_fault_start();
+	vm_fault_t ret;
+
+	mmap_stat_inc(faults);
+
+	if (order != PMD_ORDER)
+		return mmap_fault_end(vmf, order, VM_FAULT_FALLBACK, t0);
+	if (addr < vma->vm_start || addr + PMD_SIZE > vma->vm_end)
+		return mmap_fault_end(vmf, order, VM_FAULT_FALLBACK, t0);
+
+	off = (vmf->pgoff & MMAP_PGOFF_MASK) -
+	      ((vmf->address - addr) >> PAGE_SHIFT);
+	pfn = mmap_buf_pfn(buf) + off;
+	if (!IS_ALIGNED(pfn, 1UL << PMD_ORDER) ||
+	    off + (1UL << PMD_ORDER) > buf->size >> PAGE_SHIFT)
+		return mmap_fault_end(vmf, order, VM_FAULT_FALLBACK, t0);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+	ret = vmf_insert_pfn_pmd(vmf, pfn, vmf->flags & FAULT_FLAG_WRITE);
+#else
+	ret = vmf_insert_pfn_pmd(vmf, __pfn_to_pfn_t(pfn, PFN_DEV),
+				 vmf->flags & FAULT_FLAG_WRITE);
+#endif
+	if (ret == VM_FAULT_NOPAGE)
+		atomic_long_inc(&buf->huge_maps);
+	return mmap_fault_end(vmf, order, ret, t0);
+}
+#endif
+
+/* mappings populated at fault time */
+static const struct vm_operations_struct mmap_fault_vm_ops = {
+	.open = mmap_vma_open,
+	.close = mmap_vma_close,
+	.fault = mmap_vm_fault,
+#ifdef CONFIG_ARCH_SUPPORTS_PMD_PFNMAP
+	.huge_fault = mmap_vm_huge_fault,
+#endif
+};
+
+/*
+ * fault handler of the mappings of the per-CPU rings: slot n of the mapping
+ * is the ring of CPU n
+ */
+static vm_fault_t mmap_percpu_fault(struct vm_fault *vmf)
+{
+	unsigned long off = vmf->pgoff & MMAP_PGOFF_MASK;
+	unsigned long slot_pages = buf_size >> PAGE_SHIFT;
+	unsigned long cpu = off / slot_pages;
+	struct mmap_buf *buf;
+	u64 t0 = mmap_fault_start();
+	vm_fault_t ret;
+
+	mmap_stat_inc(faults);
+
+	if (cpu >= nr_cpu_ids)
+		return mmap_fault_end(vmf, 0, VM_FAULT_SIGBUS, t0);
+	/* pairs with the release store in mmap_percpu_prepare() */
+	buf = smp_load_acquire(per_cpu_ptr(&mmap_percpu_buf, cpu));
+	if (!buf)
+		return mmap_fault_end(vmf, 0, VM_FAULT_SIGBUS, t0);
+	ret = vmf_insert_pfn(vmf->vma, vmf->address & PAGE_MASK,
+			     mmap_buf_pfn(buf) + off % slot_pages);
+	if (ret == VM_FAULT_NOPAGE)
+		atomic_long_inc(&buf->page_maps);
+	return mmap_fault_end(vmf, 0, ret, t0);
+}
+
+/*
+ * the slots live until the module is unloaded, no reference is needed: the
+ * private data of the VMAs has no buffer
+ */
+static const struct vm_operations_struct mmap_percpu_vm_ops = {
+	.open = mmap_vma_open,
+	.close = mmap_vma_close,
+	.fault = mmap_percpu_fault,
+};
+
+/* map the per-CPU rings, one after the other, at fault time */
+static int mmap_percpu_mmap(struct vm_area_struct *vma, unsigned long mode,
+			    unsigned long off)
+{
+	unsigned long length = vma->vm_end - vma->vm_start;
+	unsigned long size = (unsigned long)nr_cpu_ids * buf_size;
+	struct mmap_vma *mv;
+
+	if (!percpu_bufs || (vma->vm_pgoff & MMAP_PGOFF_PREFAULT))
+		return -EINVAL;
+	/* the rings are cached */
+	if (mode != MMAP_ALLOC_MAP_DEFAULT && mode != MMAP_ALLOC_MAP_CACHED)
+		return -EINVAL;
+	if (off >= size >> PAGE_SHIFT || length > size - (off << PAGE_SHIFT))
+		return -EIO;
+	mv = mmap_vma_alloc(NULL, length, GFP_KERNEL);
+	if (!mv)
+		return -ENOMEM;
+
+	mmap_vma_set_flags(vma, VM_PFNMAP | VM_IO | VM_DONTEXPAND |
+			   VM_DONTDUMP);
+	vma->vm_ops = &mmap_percpu_vm_ops;
+	vma->vm_private_data = mv;
+	trace_mmap_alloc_mmap(MMAP_ALLOC_PERCPU_ID, off << PAGE_SHIFT, length,
+			      mode, MMAP_PATH_PERCPU, 0, 0);
+	return 0;
+}
+
+/* mapping mode matching the kernel mapping of a buffer with struct pages */
+static unsigned long mmap_buf_mode(struct mmap_buf *buf)
+{
+	if (buf->flags & MMAP_ALLOC_F_CACHED)
+		return MMAP_ALLOC_MAP_CACHED;
+	if (buf->flags & MMAP_ALLOC_F_WC)
+		return MMAP_ALLOC_MAP_WC;
+	return MMAP_ALLOC_MAP_NONCACHED;
+}
+
+/* page protection of a mapping mode */
+static pgprot_t mmap_mode_pgprot(unsigned long mode, pgprot_t prot)
+{
+	switch (mode) {
+	case MMAP_ALLOC_MAP_WC:
+		return pgprot_writecombine(prot);
+	case MMAP_ALLOC_MAP_CACHED:
+		return prot;
+	default:
+		return pgprot_noncached(prot);
+	}
+}
+
+/*
+ * map the VMA onto the buffer, starting at page off, with the given
+ * protection
+ */
+static int mmap_remap(struct vm_area_struct *vma, struct mmap_buf *buf,
+		      unsigned long off, pgprot_t prot)
+{
+	vma->vm_page_prot = prot;
+	/* map the whole physically contiguous area in one piece */
+	return remap_pfn_range(vma, vma->vm_start, mmap_buf_pfn(buf) + off,
+			       vma->vm_end - vma->vm_start, vma->vm_page_prot);
+}
+
+/*
+ * populate the VMA with the pages of the buffer starting at page off, in
+ * batches of MMAP_PREFAULT_BATCH pages
+ */
+static int mmap_insert_pages(struct vm_area_struct *vma, struct mmap_buf *buf,
+			     unsigned long off)
+{
+	unsigned long pfn = mmap_buf_pfn(buf) + off;
+	unsigned long npages = vma_pages(vma);
+	unsigned long addr = vma->vm_start;
+	unsigned long i, j, n, left;
+	struct page **pages;
+	int ret = 0;
+
+	pages = kmalloc_array(MMAP_PREFAULT_BATCH, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+
+	for (i = 0; i < npages && !ret; i += n) {
+		n = min_t(unsigned long, npages - i, MMAP_PREFAULT_BATCH);
+		for (j = 0; j < n; j++)
+			pages[j] = pfn_to_page(pfn + i + j);
+		left = n;
+		ret = vm_insert_pages(vma, addr, pages, &left);
+		if (!ret && left)
+			ret = -EFAULT;
+		addr += n << PAGE_SHIFT;
+	}
+	kfree(pages);
+	return ret;
+}
+
+// helper function, mmap's the allocated area which is physically contiguous
+int mmap_kmem(struct file *filp, struct vm_area_struct *vma)
+{
+        int ret;
+        unsigned long length = vma->vm_end - vma->vm_start;
+	unsigned long id = (vma->vm_pgoff >> MMAP_PGOFF_ID_SHIFT) &
+			   MMAP_ID_MASK;
+	unsigned long mode = (vma->vm_pgoff >> MMAP_PGOFF_MODE_SHIFT) &
+			     MMAP_MODE_MASK;
+	unsigned long off = vma->vm_pgoff & MMAP_PGOFF_MASK;
+	unsigned long pgoff = vma->vm_pgoff;
+	struct mmap_file *mf = filp->private_data;
+	struct mmap_buf *buf;
+	struct mmap_vma *mv;
+	enum mmap_alloc_path path;
+	bool lazy, prefault;
+	u64 start, elapsed;
+
+	if ((vma->vm_pgoff & MMAP_PGOFF_RESERVED) ||
+	    mode > MMAP_ALLOC_MAP_CACHED)
+		return -EINVAL;
+	/*
+	 * the copy-on-write mappings are refused on every path: the fault
+	 * handlers cannot handle them, and remap_pfn_range() relies on
+	 * vm_pgoff, which is the cookie for us, to tell raw pfns from pages
+	 */
+	if (is_cow_mapping(vma->vm_flags))
+		return -EINVAL;
+	if (id == MMAP_ALLOC_PERCPU_ID)
+		return mmap_percpu_mmap(vma, mode, off);
+	buf = mmap_file_get_buf(mf, id);
+	if (!buf)
+		return -EINVAL;
+
+	/* the huge buffers are always mapped at fault time */
+	lazy = (vma->vm_pgoff & MMAP_PGOFF_LAZY) ||
+	       (buf->flags & MMAP_ALLOC_F_HUGE);
+	prefault = vma->vm_pgoff & MMAP_PGOFF_PREFAULT;
+	if (lazy && prefault) {
+		ret = -EINVAL;
+		goto out_put;
+	}
+
+        /* check length - do not allow larger mappings than the number of
+           pages allocated */
+	if (off >= buf->size >> PAGE_SHIFT ||
+	    length > buf->size - (off << PAGE_SHIFT)) {
+		ret = -EIO;
+		goto out_put;
+	}
+
+	/* the cached and write-combining buffers can only be mapped as such
+	 * and vice versa, so that the user mapping matches the kernel one */
+	if (buf->flags & MMAP_ALLOC_F_CACHED) {
+		if (mode != MMAP_ALLOC_MAP_DEFAULT &&
+		    mode != MMAP_ALLOC_MAP_CACHED) {
+			ret = -EINVAL;
+			goto out_put;
+		}
+		mode = MMAP_ALLOC_MAP_CACHED;
+	} else if (buf->flags & MMAP_ALLOC_F_WC) {
+		if (mode != MMAP_ALLOC_MAP_DEFAULT &&
+		    mode != MMAP_ALLOC_MAP_WC) {
+			ret = -EINVAL;
+			goto out_put;
+		}
+		mode = MMAP_ALLOC_MAP_WC;
+	} else if (buf->backend == MMAP_ALLOC_BACKEND_COHERENT) {
+		/* only dma_mmap_coherent() knows how to map it */
+		if (mode != MMAP_ALLOC_MAP_DEFAULT || lazy) {
+			ret = -EINVAL;
+			goto out_put;
+		}
+	} else if (mode == MMAP_ALLOC_MAP_CACHED ||
+		   mode == MMAP_ALLOC_MAP_WC) {
+		ret = -EINVAL;
+		goto out_put;
+	}
+
+	mv = mmap_vma_alloc(buf, length, GFP_KERNEL);
+	if (!mv) {
+		ret = -ENOMEM;
+		goto out_put;
+	}
+
+	start = ktime_get_ns();
+	if (lazy) {
+		/* populated by the fault handlers, with PMDs if possible */
+		path = (buf->flags & MMAP_ALLOC_F_HUGE) ?
+		       MMAP_PATH_HUGE_FAULT : MMAP_PATH_FAULT;
+		vma->vm_page_prot = mmap_mode_pgprot(mode, vma->vm_page_prot);
+		mmap_vma_set_flags(vma, VM_PFNMAP | VM_IO | VM_DONTEXPAND |
+				   VM_DONTDUMP);
+		if (buf->flags & MMAP_ALLOC_F_HUGE)
+			mmap_vma_set_flags(vma, VM_HUGEPAGE);
+		ret = 0;
+	}
+/* #ifdef ARCH_HAS_DMA_MMAP_COHERENT */
+	else if (buf->backend == MMAP_ALLOC_BACKEND_COHERENT) {
+		path = MMAP_PATH_DMA_MMAP_COHERENT;
+		/* dma_mmap_coherent() takes the offset from vm_pgoff */
+		vma->vm_pgoff = off;
+		ret = dma_mmap_coherent(mmap_device, vma, buf->cpu_addr,
+					buf->dma_handle, buf->size);
+		vma->vm_pgoff = pgoff;
+	}
+/* #endif */
+	else if (prefault) {
+		/* vm_insert_pages() needs refcounted pages, and maps them with
+		 * the same attributes as the kernel */
+		if (mode == MMAP_ALLOC_MAP_CACHED) {
+			path = MMAP_PATH_INSERT_PAGES;
+			ret = mmap_insert_pages(vma, buf, off);
+		} else {
+			path = MMAP_PATH_REMAP_PREFAULT;
+			ret = mmap_remap(vma, buf, off,
+					 mmap_mode_pgprot(mode,
+							  vma->vm_page_prot));
+		}
+		atomic_long_inc(&buf->prefaults);
+		atomic64_add(ktime_get_ns() - start, &buf->prefault_ns);
+	}
+	else {
+		path = MMAP_PATH_REMAP;
+		ret = mmap_remap(vma, buf, off,
+				 mmap_mode_pgprot(mode, vma->vm_page_prot));
+	}
+	elapsed = ktime_get_ns() - start;
+	mmap_stat_add(remap_ns, elapsed);
+	trace_mmap_alloc_mmap(id, off << PAGE_SHIFT, length, mode, path, ret,
+			      elapsed);
+        if (ret < 0) {
+		pr_err_ratelimited("remap failed (%d)\n", ret);
+		goto out_free;
+        }
+
+	/* the reference taken above now belongs to the VMA */
+	vma->vm_ops = lazy ? &mmap_fault_vm_ops : &mmap_vm_ops;
+	vma->vm_private_data = mv;
+        return 0;
+
+  out_free:
+	kfree(mv);
+  out_put:
+	mmap_buf_put(buf);
+	return ret;
+}
+
+/* character device mmap method */
+static int mmap_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	int ret;
+
+	mmap_stat_inc(mmaps);
+	ret = mmap_kmem(filp, vma);
+	if (ret < 0)
+		mmap_stat_inc(mmap_errors[min(-ret, MMAP_STATS_ERRNOS - 1)]);
+	else
+		/* the VMAs created by mmap() are not opened */
+		mmap_stats_vma_open(vma);
+	return ret;
+}
+
+/* fill the description of a buffer returned by ALLOC and QUERY */
+static void mmap_buf_info(struct mmap_buf *buf, u32 id,
+			  struct mmap_alloc_buf *info)
+{
+	info->id = id;
+	info->flags = buf->flags;
+	info->backend = buf->backend;
+	info->node = mmap_buf_nid(buf);
+	info->size = buf->size;
+	/* same policy as /proc/pid/pagemap: with dma-direct the device
+	 * address is the physical one */
+	info->dma_addr = 0;
+	info->phys_addr = 0;
+	if (capable(CAP_SYS_RAWIO)) {
+		info->dma_addr = buf->dma_handle;
+		if (buf->backend != MMAP_ALLOC_BACKEND_COHERENT)
+			info->phys_addr = PFN_PHYS(mmap_buf_pfn(buf));
+	}
+	info->offset = MMAP_ALLOC_OFFSET(id);
+	info->huge_maps = atomic_long_read(&buf->huge_maps);
+	info->page_maps = atomic_long_read(&buf->page_maps);
+	info->prefaults = atomic_long_read(&buf->prefaults);
+	info->prefault_ns = atomic64_read(&buf->prefault_ns);
+}
+
+/*
+ * read() and write(): the file position is the mmap offset cookie of a
+ * buffer plus the offset within it, so that the buffer is selected as in
+ * mmap(). The copies are split in chunks to reschedule in between.
+ * They go through the kernel mapping of the buffer, which has the type of
+ * its user mappings: reading a non-cached buffer runs at uncached speed.
+ */
+#define MMAP_RW_CHUNK	SZ_1M
+/* mode and flags bits are not valid in a file position */
+#define MMAP_POS_MAX	(MMAP_ALLOC_MODE(1) - 1)
+
+static ssize_t mmap_rw_iter(struct kiocb *iocb, struct iov_iter *iter,
+			    bool write)
+{
+	struct mmap_file *mf = iocb->ki_filp->private_data;
+	loff_t pos = iocb->ki_pos;
+	unsigned long id = pos >> MMAP_ALLOC_ID_SHIFT;
+	size_t off = pos & (MMAP_ALLOC_MAX_SIZE - 1);
+	size_t count, chunk, n, done = 0;
+	struct mmap_buf *buf;
+	bool sync;
+
+	if (pos < 0 || pos > MMAP_POS_MAX)
+		return -EINVAL;
+	buf = mmap_file_get_buf(mf, id);
+	if (!buf)
+		return -EINVAL;
+	if (off >= buf->size) {
+		mmap_buf_put(buf);
+		return write ? -ENOSPC : 0;
+	}
+	count = min_t(size_t, iov_iter_count(iter), buf->size - off);
+
+	sync = mmap_buf_cached_alias(buf);
+	if (sync && !write)
+		dma_sync_single_range_for_cpu(mmap_device, buf->dma_handle,
+					      off, count, DMA_BIDIRECTIONAL);
+	while (done < count) {
+		chunk = min_t(size_t, count - done, MMAP_RW_CHUNK);
+		if (write)
+			n = copy_from_iter(buf->cpu_addr + off + done, chunk,
+					   iter);
+		else
+			n = copy_to_iter(buf->cpu_addr + off + done, chunk,
+					 iter);
+		done += n;
+		if (n < chunk)
+			break;
+		cond_resched();
+	}
+	if (sync && write && done)
+		dma_sync_single_range_for_device(mmap_device, buf->dma_handle,
+						 off, done, DMA_BIDIRECTIONAL);
+	mmap_buf_put(buf);
+
+	if (!done)
+		return -EFAULT;
+	iocb->ki_pos += done;
+	return done;
+}
+
+/* character device read method, also used by read(), readv() and io_uring */
+static ssize_t mmap_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	if (!iov_iter_count(to))
+		return 0;
+	return mmap_rw_iter(iocb, to, false);
+}
+
+/* character device write method, also used by write(), writev() and
+ * io_uring */
+static ssize_t mmap_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	if (!iov_iter_count(from))
+		return 0;
+	return mmap_rw_iter(iocb, from, true);
+}
+
+/*
+ * splice() and sendfile(): the pipe buffers point to the pages of the buffer
+ * and each of them holds a reference to it, so that the pages stay valid
+ * until the data has been consumed, and to the module, which provides their
+ * operations. The data is not copied, so the buffer
+ * should not be overwritten until then.
+ */
+static void mmap_pipe_buf_release(struct pipe_inode_info *pipe,
+				  struct pipe_buffer *pbuf)
+{
+	mmap_buf_put((struct mmap_buf *)pbuf->private);
+	module_put(THIS_MODULE);
+}
+
+static bool mmap_pipe_buf_get(struct pipe_inode_info *pipe,
+			      struct pipe_buffer *pbuf)
+{
+	__module_get(THIS_MODULE);
+	mmap_buf_get((struct mmap_buf *)pbuf->private);
+	return true;
+}
+
+static const struct pipe_buf_operations mmap_pipe_buf_ops = {
+	.release = mmap_pipe_buf_release,
+	.get = mmap_pipe_buf_get,
+};
+
+/* character device splice_read method */
+static ssize_t mmap_splice_read(struct file *in, loff_t *ppos,
+				struct pipe_inode_info *pipe, size_t len,
+				unsigned int flags)
+{
+	struct mmap_file *mf = in->private_data;
+	loff_t pos = *ppos;
+	size_t off = pos & (MMAP_ALLOC_MAX_SIZE - 1);
+	struct pipe_buffer pbuf;
+	struct mmap_buf *buf;
+	ssize_t n, ret = 0, done = 0;
+
+	if (pos < 0 || pos > MMAP_POS_MAX)
+		return -EINVAL;
+	buf = mmap_file_get_buf(mf, pos >> MMAP_ALLOC_ID_SHIFT);
+	if (!buf)
+		return -EINVAL;
+	/* the coherent buffers may have no struct pages, copy them */
+	if (buf->backend == MMAP_ALLOC_BACKEND_COHERENT) {
+		mmap_buf_put(buf);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+		return copy_splice_read(in, ppos, pipe, len, flags);
+#else
+		return generic_file_splice_read(in, ppos, pipe, len, flags);
+#endif
+	}
+	if (off >= buf->size)
+		goto out_put;
+	len = min_t(size_t, len, buf->size - off);
+
+	dma_sync_single_range_for_cpu(mmap_device, buf->dma_handle, off, len,
+				      DMA_BIDIRECTIONAL);
+	while (len) {
+		pbuf = (struct pipe_buffer) {
+			.page = pfn_to_page(mmap_buf_pfn(buf) +
+					    (off >> PAGE_SHIFT)),
+			.offset = offset_in_page(off),
+			.len = min_t(size_t, len,
+				     PAGE_SIZE - offset_in_page(off)),
+			.ops = &mmap_pipe_buf_ops,
+			.private = (unsigned long)buf,
+		};
+		/* dropped by add_to_pipe() on failure */
+		__module_get(THIS_MODULE);
+		mmap_buf_get(buf);
+		n = add_to_pipe(pipe, &pbuf);
+		if (n < 0) {
+			ret = n;
+			break;
+		}
+		done += n;
+		off += n;
+		len -= n;
+	}
+	*ppos += done;
+
+  out_put:
+	mmap_buf_put(buf);
+	return done ? done : ret;
+}
+
+/*
+ * character device llseek method
+ * SEEK_END is relative to the end of the buffer of the current position.
+ */
+static loff_t mmap_llseek(struct file *filp, loff_t offset, int whence)
+{
+	struct mmap_file *mf = filp->private_data;
+	struct mmap_buf *buf;
+	unsigned long id;
+	loff_t end;
+
+	switch (whence) {
+	case SEEK_SET:
+	case SEEK_CUR:
+		return generic_file_llseek_size(filp, offset, whence,
+						MMAP_POS_MAX, MMAP_POS_MAX);
+	case SEEK_END:
+		id = (filp->f_pos >> MMAP_ALLOC_ID_SHIFT) & MMAP_ID_MASK;
+		buf = mmap_file_get_buf(mf, id);
+		if (!buf)
+			return -EINVAL;
+		end = MMAP_ALLOC_OFFSET(id) + buf->size;
+		mmap_buf_put(buf);
+		return generic_file_llseek_size(filp, offset, whence,
+						MMAP_POS_MAX, end);
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * dma-buf exporter: each exported dma-buf holds a reference to its buffer.
+ * The importers get the buffer as a scatterlist of chunks of at most
+ * MMAP_SG_CHUNK bytes, since a single entry cannot describe 4 GiB.
+ */
+#define MMAP_SG_CHUNK	SZ_1G
+
+/* describe a buffer backed by struct pages */
+static int mmap_buf_sgtable(struct mmap_buf *buf, struct sg_table *sgt)
+{
+	unsigned long pfn = mmap_buf_pfn(buf);
+	struct scatterlist *sg;
+	unsigned int i;
+	size_t len;
+	int ret;
+
+	ret = sg_alloc_table(sgt, DIV_ROUND_UP(buf->size, MMAP_SG_CHUNK),
+			     GFP_KERNEL);
+	if (ret < 0)
+		return ret;
+	for_each_sgtable_sg(sgt, sg, i) {
+		len = min_t(size_t, buf->size - (size_t)i * MMAP_SG_CHUNK,
+			    MMAP_SG_CHUNK);
+		sg_set_page(sg, pfn_to_page(pfn + i * (MMAP_SG_CHUNK >>
+						       PAGE_SHIFT)), len, 0);
+	}
+	return 0;
+}
+
+static struct sg_table *mmap_dmabuf_map(struct dma_buf_attachment *attach,
+					enum dma_data_direction dir)
+{
+	struct mmap_buf *buf = attach->dmabuf->priv;
+	struct sg_table *sgt;
+	int ret;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+	if (buf->backend == MMAP_ALLOC_BACKEND_COHERENT)
+		ret = dma_get_sgtable(mmap_device, sgt, buf->cpu_addr,
+				      buf->dma_handle, buf->size);
+	else
+		ret = mmap_buf_sgtable(buf, sgt);
+	if (ret < 0)
+		goto out_free;
+	ret = dma_map_sgtable(attach->dev, sgt, dir, 0);
+	if (ret < 0)
+		goto out_table;
+	return sgt;
+
+  out_table:
+	sg_free_table(sgt);
+  out_free:
+	kfree(sgt);
+	return ERR_PTR(ret);
+}
+
+static void mmap_dmabuf_unmap(struct dma_buf_attachment *attach,
+			      struct sg_table *sgt,
+			      enum dma_data_direction dir)
+{
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static void mmap_dmabuf_release(struct dma_buf *dmabuf)
+{
+	mmap_buf_put(dmabuf->priv);
+}
+
+/*
+ * DMA_BUF_IOCTL_SYNC and the kernel CPU accessors: the cached buffers are
+ * handed over like with the SYNC ioctls, the others need nothing
+ */
+static int mmap_dmabuf_begin_cpu_access(struct dma_buf *dmabuf,
+					enum dma_data_direction dir)
+{
+	struct mmap_buf *buf = dmabuf->priv;
+
+	if (buf->flags & MMAP_ALLOC_F_CACHED)
+		dma_sync_single_for_cpu(mmap_device, buf->dma_handle,
+					buf->size, DMA_BIDIRECTIONAL);
+	return 0;
+}
+
+static int mmap_dmabuf_end_cpu_access(struct dma_buf *dmabuf,
+				      enum dma_data_direction dir)
+{
+	struct mmap_buf *buf = dmabuf->priv;
+
+	if (buf->flags & MMAP_ALLOC_F_CACHED)
+		dma_sync_single_for_device(mmap_device, buf->dma_handle,
+					   buf->size, DMA_BIDIRECTIONAL);
+	return 0;
+}
+
+/* map the dma-buf with the same attributes as the default mmap_kmem() path */
+static int mmap_dmabuf_mmap(struct dma_buf *dmabuf,
+			    struct vm_area_struct *vma)
+{
+	struct mmap_buf *buf = dmabuf->priv;
+	unsigned long length = vma->vm_end - vma->vm_start;
+
+	if (vma->vm_pgoff >= buf->size >> PAGE_SHIFT ||
+	    length > buf->size - (vma->vm_pgoff << PAGE_SHIFT))
+		return -EINVAL;
+
+	if (buf->backend == MMAP_ALLOC_BACKEND_COHERENT)
+		return dma_mmap_coherent(mmap_device, vma, buf->cpu_addr,
+					 buf->dma_handle, buf->size);
+	return mmap_remap(vma, buf, vma->vm_pgoff,
+			  mmap_mode_pgprot(mmap_buf_mode(buf),
+					   vma->vm_page_prot));
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+static int mmap_dmabuf_vmap(struct dma_buf *dmabuf, struct iosys_map *map)
+{
+	struct mmap_buf *buf = dmabuf->priv;
+
+	iosys_map_set_vaddr(map, buf->cpu_addr);
+	return 0;
+}
+#endif
+
+static const struct dma_buf_ops mmap_dmabuf_ops = {
+	.map_dma_buf = mmap_dmabuf_map,
+	.unmap_dma_buf = mmap_dmabuf_unmap,
+	.release = mmap_dmabuf_release,
+	.begin_cpu_access = mmap_dmabuf_begin_cpu_access,
+	.end_cpu_access = mmap_dmabuf_end_cpu_access,
+	.mmap = mmap_dmabuf_mmap,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+	.vmap = mmap_dmabuf_vmap,
+#endif
+};
+
+static long mmap_ioctl_alloc(struct mmap_file *mf,
+			     struct mmap_alloc_buf __user *arg)
+{
+	struct mmap_alloc_buf info;
+	struct mmap_buf *buf;
+	int id;
+
+	if (copy_from_user(&info, arg, sizeof(info)))
+		return -EFAULT;
+	if ((info.flags & ~(MMAP_ALLOC_F_CACHED | MMAP_ALLOC_F_HUGE |
+			    MMAP_ALLOC_F_NODE | MMAP_ALLOC_F_POOL |
+			    MMAP_ALLOC_F_WC)) ||
+	    !info.size || info.size > MMAP_ALLOC_MAX_SIZE)
+		return -EINVAL;
+	if ((info.flags & MMAP_ALLOC_F_CACHED) &&
+	    (info.flags & MMAP_ALLOC_F_WC))
+		return -EINVAL;
+	/* the pool buffers take the attributes of the region */
+	if ((info.flags & MMAP_ALLOC_F_POOL) && info.flags != MMAP_ALLOC_F_POOL)
+		return -EINVAL;
+	if (!(info.flags & MMAP_ALLOC_F_NODE))
+		info.node = NUMA_NO_NODE;
+	else if (info.node < 0 || info.node >= MAX_NUMNODES ||
+		 !node_online(info.node))
+		return -EINVAL;
+
+	if (info.flags & MMAP_ALLOC_F_POOL)
+		buf = mmap_pool_alloc(info.size);
+	else
+		buf = mmap_buf_alloc(info.size, info.flags, info.node);
+	if (!buf)
+		return -ENOMEM;
+
+	id = mmap_file_add_buf(mf, buf);
+	if (id < 0)
+		return id;
+
+	mmap_buf_info(buf, id, &info);
+	if (copy_to_user(arg, &info, sizeof(info))) {
+		mmap_file_remove_buf(mf, id);
+		return -EFAULT;
+	}
+	return 0;
+}
+
+/* lay out a slab of count objects of obj_size bytes in a new buffer */
+static long mmap_ioctl_slab_create(struct mmap_file *mf,
+				   struct mmap_alloc_slab_create __user *arg)
+{
+	struct mmap_alloc_slab_create req;
+	struct mmap_alloc_slab *hdr;
+	struct mmap_buf *buf;
+	u64 stride, data_offset, size;
+	u32 i, *next;
+	int id;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+	if (req.flags || !req.obj_size || !req.count ||
+	    req.count == MMAP_ALLOC_SLAB_NIL)
+		return -EINVAL;
+
+	/* keep the objects on separate cache lines, or pages if larger */
+	stride = req.obj_size >= PAGE_SIZE ? PAGE_ALIGN((u64)req.obj_size) :
+		 ALIGN(req.obj_size, MMAP_ALLOC_SLAB_CACHELINE);
+	data_offset = PAGE_ALIGN(sizeof(*hdr) + (u64)req.count * sizeof(u32));
+	/* bound the product before computing it, so it cannot wrap */
+	if (data_offset > MMAP_ALLOC_MAX_SIZE ||
+	    req.count > (MMAP_ALLOC_MAX_SIZE - data_offset) / stride)
+		return -EINVAL;
+	size = data_offset + req.count * stride;
+
+	/* cached, as atomic operations may not work on non-cached memory */
+	buf = mmap_buf_alloc(size, MMAP_ALLOC_F_CACHED, NUMA_NO_NODE);
+	if (!buf)
+		return -ENOMEM;
+
+	hdr = buf->cpu_addr;
+	next = buf->cpu_addr + sizeof(*hdr);
+	for (i = 0; i < req.count - 1; i++) {
+		next[i] = i + 1;
+		if (!(i % (SZ_1M / sizeof(u32))))
+			cond_resched();
+	}
+	next[i] = MMAP_ALLOC_SLAB_NIL;
+	hdr->version = MMAP_ALLOC_SLAB_VERSION;
+	hdr->obj_size = req.obj_size;
+	hdr->count = req.count;
+	hdr->stride = stride;
+	hdr->next_offset = sizeof(*hdr);
+	hdr->data_offset = data_offset;
+	/* all the objects are free, starting from 0 */
+	hdr->head = 0;
+	hdr->magic = MMAP_ALLOC_SLAB_MAGIC;
+
+	id = mmap_file_add_buf(mf, buf);
+	if (id < 0)
+		return id;
+
+	req.id = id;
+	req.size = buf->size;
+	req.offset = MMAP_ALLOC_OFFSET(id);
+	if (copy_to_user(arg, &req, sizeof(req))) {
+		mmap_file_remove_buf(mf, id);
+		return -EFAULT;
+	}
+	return 0;
+}
+
+static long mmap_ioctl_free(struct mmap_file *mf, u32 __user *arg)
+{
+	struct mmap_buf *buf;
+	u32 id;
+
+	if (get_user(id, arg))
+		return -EFAULT;
+
+	mutex_lock(&mf->lock);
+	buf = idr_remove(&mf->bufs, id);
+	mutex_unlock(&mf->lock);
+	if (!buf)
+		return -EINVAL;
+
+	/* the memory is released once the last mapping goes away */
+	mmap_buf_put(buf);
+	return 0;
+}
+
+static long mmap_ioctl_query(struct mmap_file *mf,
+			     struct mmap_alloc_buf __user *arg)
+{
+	struct mmap_alloc_buf info;
+	struct mmap_buf *buf;
+	u32 id;
+
+	if (get_user(id, &arg->id))
+		return -EFAULT;
+
+	buf = mmap_file_get_buf(mf, id);
+	if (!buf)
+		return -EINVAL;
+	memset(&info, 0, sizeof(info));
+	mmap_buf_info(buf, id, &info);
+	mmap_buf_put(buf);
+
+	if (copy_to_user(arg, &info, sizeof(info)))
+		return -EFAULT;
+	return 0;
+}
+
+/* pass the ownership of a range of a cached buffer to the CPU or device */
+static long mmap_ioctl_sync(struct mmap_file *mf,
+			    struct mmap_alloc_sync __user *arg,
+			    bool for_cpu)
+{
+	struct mmap_alloc_sync sync;
+	struct mmap_buf *buf;
+	long ret = 0;
+
+	if (copy_from_user(&sync, arg, sizeof(sync)))
+		return -EFAULT;
+
+	buf = mmap_file_get_buf(mf, sync.id);
+	if (!buf)
+		return -EINVAL;
+	if (sync.offset > buf->size || sync.length > buf->size - sync.offset) {
+		ret = -EINVAL;
+		goto out_put;
+	}
+
+	/* nothing to do for coherent buffers */
+	if (!(buf->flags & MMAP_ALLOC_F_CACHED))
+		goto out_put;
+
+	if (for_cpu)
+		dma_sync_single_range_for_cpu(mmap_device, buf->dma_handle,
+					      sync.offset, sync.length,
+					      DMA_BIDIRECTIONAL);
+	else
+		dma_sync_single_range_for_device(mmap_device, buf->dma_handle,
+						 sync.offset, sync.length,
+						 DMA_BIDIRECTIONAL);
+  out_put:
+	mmap_buf_put(buf);
+	return ret;
+}
+
+/* export a buffer as a dma-buf */
+static long mmap_ioctl_export(struct mmap_file *mf,
+			      struct mmap_alloc_export __user *arg)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct mmap_alloc_export req;
+	struct dma_buf *dmabuf;
+	struct mmap_buf *buf;
+	int fd;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+	if (req.flags & ~O_CLOEXEC)
+		return -EINVAL;
+
+	buf = mmap_file_get_buf(mf, req.id);
+	if (!buf)
+		return -EINVAL;
+
+	/* the reference taken above now belongs to the dma-buf */
+	exp_info.ops = &mmap_dmabuf_ops;
+	exp_info.size = buf->size;
+	exp_info.flags = O_RDWR;
+	exp_info.priv = buf;
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf)) {
+		mmap_buf_put(buf);
+		return PTR_ERR(dmabuf);
+	}
+
+	fd = dma_buf_fd(dmabuf, req.flags);
+	if (fd < 0) {
+		dma_buf_put(dmabuf);
+		return fd;
+	}
+	/* the fd is installed already, it is left to the caller */
+	if (put_user(fd, &arg->fd))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * select the buffer watched by poll() and mark everything published so far
+ * as seen. The watched buffer cannot be changed afterwards, as the waiters
+ * of poll() and epoll stay queued on it until the file is closed.
+ */
+static long mmap_ioctl_watch(struct mmap_file *mf, u32 __user *arg)
+{
+	struct mmap_buf *buf;
+	u32 id;
+	long ret = 0;
+
+	if (get_user(id, arg))
+		return -EFAULT;
+
+	buf = mmap_file_get_buf(mf, id);
+	if (!buf)
+		return -EINVAL;
+	mutex_lock(&mf->lock);
+	if (!mf->watch) {
+		/* the reference is dropped at release */
+		mf->watch = buf;
+		buf = NULL;
+	} else if (mf->watch != buf) {
+		ret = -EBUSY;
+		goto out_unlock;
+	}
+	mf->seen = atomic64_read(&mf->watch->published);
+  out_unlock:
+	mutex_unlock(&mf->lock);
+	if (buf)
+		mmap_buf_put(buf);
+	return ret;
+}
+
+/* tell the readers polling the buffer that new data is available */
+static long mmap_publish(struct mmap_file *mf, u32 id, u64 records,
+			 u64 bytes)
+{
+	struct mmap_buf *buf;
+
+	buf = mmap_file_get_buf(mf, id);
+	if (!buf)
+		return -EINVAL;
+	atomic64_inc(&buf->published);
+	mmap_buf_wake(buf);
+	mmap_buf_ring_doorbells(buf, records, bytes);
+	mmap_buf_put(buf);
+	return 0;
+}
+
+static long mmap_ioctl_publish(struct mmap_file *mf, u32 __user *arg)
+{
+	u32 id;
+
+	if (get_user(id, arg))
+		return -EFAULT;
+	return mmap_publish(mf, id, 1, 0);
+}
+
+/* like PUBLISH, telling the doorbells how much data has been produced */
+static long mmap_ioctl_publish_data(struct mmap_file *mf,
+				    struct mmap_alloc_publish __user *arg)
+{
+	struct mmap_alloc_publish req;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+	return mmap_publish(mf, req.id, req.records, req.bytes);
+}
+
+/* unlink a doorbell from its buffer and free it, mf->lock must be held */
+static void mmap_doorbell_unbind(struct mmap_doorbell *db)
+{
+	spin_lock_irq(&db->buf->doorbell_lock);
+	list_del(&db->buf_node);
+	spin_unlock_irq(&db->buf->doorbell_lock);
+	list_del(&db->file_node);
+
+	eventfd_ctx_put(db->ctx);
+	mmap_buf_put(db->buf);
+	kfree(db);
+}
+
+/*
+ * bind an eventfd to a buffer, replacing the one already bound by the file,
+ * or unbind it if fd is negative
+ */
+static long mmap_ioctl_doorbell(struct mmap_file *mf,
+				struct mmap_alloc_doorbell __user *arg)
+{
+	struct mmap_alloc_doorbell req;
+	struct mmap_doorbell *db, *new = NULL;
+	struct mmap_buf *buf;
+	long ret = 0;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+	if (req.pad)
+		return -EINVAL;
+
+	buf = mmap_file_get_buf(mf, req.id);
+	if (!buf)
+		return -EINVAL;
+
+	if (req.fd >= 0) {
+		new = kzalloc(sizeof(*new), GFP_KERNEL);
+		if (!new) {
+			ret = -ENOMEM;
+			goto out_put;
+		}
+		new->ctx = eventfd_ctx_fdget(req.fd);
+		if (IS_ERR(new->ctx)) {
+			ret = PTR_ERR(new->ctx);
+			kfree(new);
+			goto out_put;
+		}
+		/* without watermarks, signal every record */
+		if (!req.records && !req.bytes)
+			req.records = 1;
+		new->records = req.records ? req.records : U64_MAX;
+		new->bytes = req.bytes ? req.bytes : U64_MAX;
+		new->buf = buf;
+	}
+
+	mutex_lock(&mf->lock);
+	list_for_each_entry(db, &mf->doorbells, file_node) {
+		if (db->buf == buf) {
+			mmap_doorbell_unbind(db);
+			break;
+		}
+	}
+	if (new) {
+		spin_lock_irq(&buf->doorbell_lock);
+		list_add_tail(&new->buf_node, &buf->doorbells);
+		spin_unlock_irq(&buf->doorbell_lock);
+		list_add_tail(&new->file_node, &mf->doorbells);
+		/* the reference now belongs to the doorbell */
+		buf = NULL;
+	}
+	mutex_unlock(&mf->lock);
+
+  out_put:
+	if (buf)
+		mmap_buf_put(buf);
+	return ret;
+}
+
+/* character device ioctl method */
+static long mmap_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct mmap_file *mf = filp->private_data;
+	void __user *argp = (void __user *)arg;
+
+	switch (cmd) {
+	case MMAP_ALLOC_IOC_ALLOC:
+		return mmap_ioctl_alloc(mf, argp);
+	case MMAP_ALLOC_IOC_FREE:
+		return mmap_ioctl_free(mf, argp);
+	case MMAP_ALLOC_IOC_QUERY:
+		return mmap_ioctl_query(mf, argp);
+	case MMAP_ALLOC_IOC_SYNC_FOR_CPU:
+		return mmap_ioctl_sync(mf, argp, true);
+	case MMAP_ALLOC_IOC_SYNC_FOR_DEVICE:
+		return mmap_ioctl_sync(mf, argp, false);
+	case MMAP_ALLOC_IOC_WATCH:
+		return mmap_ioctl_watch(mf, argp);
+	case MMAP_ALLOC_IOC_PUBLISH:
+		return mmap_ioctl_publish(mf, argp);
+	case MMAP_ALLOC_IOC_PUBLISH_DATA:
+		return mmap_ioctl_publish_data(mf, argp);
+	case MMAP_ALLOC_IOC_DOORBELL:
+		return mmap_ioctl_doorbell(mf, argp);
+	case MMAP_ALLOC_IOC_EXPORT:
+		return mmap_ioctl_export(mf, argp);
+	case MMAP_ALLOC_IOC_SLAB_CREATE:
+		return mmap_ioctl_slab_create(mf, argp);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * character device poll method
+ * The file is readable when the watched buffer has been published since the
+ * last WATCH ioctl or, if it holds a ring, while the ring holds records not
+ * consumed yet: the consumers of a ring never call WATCH again, so only the
+ * ring indices count for them.
+ */
+static __poll_t mmap_poll(struct file *filp, poll_table *wait)
+{
+	struct mmap_file *mf = filp->private_data;
+	struct mmap_ring *ring;
+	struct mmap_buf *buf;
+	__poll_t mask = 0;
+
+	mutex_lock(&mf->lock);
+	buf = mf->watch;
+	if (!buf) {
+		mutex_unlock(&mf->lock);
+		return EPOLLERR;
+	}
+	poll_wait(filp, &buf->wait, wait);
+	/* pairs with the barrier in mmap_buf_wake() */
+	smp_mb();
+
+	ring = buf->ring;
+	if (ring ? READ_ONCE(ring->hdr->tail) != READ_ONCE(ring->head) :
+	    atomic64_read(&buf->published) != mf->seen)
+		mask |= EPOLLIN | EPOLLRDNORM;
+	mutex_unlock(&mf->lock);
+	return mask;
+}
+
+/* character device open method */
+static int mmap_open(struct inode *inode, struct file *filp)
+{
+	struct mmap_file *mf;
+	struct mmap_buf *buf;
+	u64 start = ktime_get_ns();
+	unsigned int i;
+	int ret;
+
+	/* with async_init the memory may not be allocated yet */
+	if (!completion_done(&mmap_setup_done)) {
+		ret = -EAGAIN;
+		if (filp->f_flags & O_NONBLOCK)
+			goto out;
+		ret = -ERESTARTSYS;
+		if (wait_for_completion_interruptible(&mmap_setup_done))
+			goto out;
+	}
+	ret = mmap_setup_ret;
+	if (ret < 0)
+		goto out;
+
+	mf = kzalloc(sizeof(*mf), GFP_KERNEL);
+	if (!mf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	/* from here on, the errors go through mmap_release() */
+	mmap_stat_inc(opens);
+	mutex_init(&mf->lock);
+	idr_init(&mf->bufs);
+	INIT_LIST_HEAD(&mf->doorbells);
+	filp->private_data = mf;
+
+	/* the default buffers get ids 0 .. nr_bufs - 1 */
+	for (i = 0; i < nr_bufs; i++) {
+		if (private_bufs) {
+			buf = mmap_alloc_default_buf();
+			if (!buf) {
+				ret = -ENOMEM;
+				goto out_release;
+			}
+		} else {
+			buf = mmap_bufs[i];
+			mmap_buf_get(buf);
+		}
+		ret = idr_alloc(&mf->bufs, buf, i, i + 1, GFP_KERNEL);
+		if (ret < 0) {
+			mmap_buf_put(buf);
+			goto out_release;
+		}
+	}
+	ret = 0;
+	goto out;
+
+  out_release:
+	mmap_release(inode, filp);
+  out:
+	trace_mmap_alloc_open(ret, ktime_get_ns() - start);
+	return ret;
+}
+
+/*
+ * character device last close method
+ * Every VMA holds a reference to the file, so this is only called after the
+ * last mapping of the buffers has gone away.
+ */
+static int mmap_release(struct inode *inode, struct file *filp)
+{
+	struct mmap_file *mf = filp->private_data;
+	struct mmap_doorbell *db, *tmp;
+	struct mmap_buf *buf;
+	u64 start = ktime_get_ns();
+	int id;
+
+	mmap_stat_inc(releases);
+
+	mutex_lock(&mf->lock);
+	list_for_each_entry_safe(db, tmp, &mf->doorbells, file_node)
+		mmap_doorbell_unbind(db);
+	mutex_unlock(&mf->lock);
+
+	idr_for_each_entry(&mf->bufs, buf, id)
+		mmap_buf_put(buf);
+	idr_destroy(&mf->bufs);
+	if (mf->watch)
+		mmap_buf_put(mf->watch);
+	kfree(mf);
+	trace_mmap_alloc_release(ktime_get_ns() - start);
+        return 0;
+}
+
+/* debugfs mmap_alloc/stats: the per-CPU statistics summed up */
+static int mmap_stats_show(struct seq_file *m, void *v)
+{
+	struct mmap_stats sum, *st;
+	unsigned int cpu, i;
+
+	memset(&sum, 0, sizeof(sum));
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(&mmap_stats, cpu);
+		sum.opens += st->opens;
+		sum.releases += st->releases;
+		sum.mmaps += st->mmaps;
+		sum.vma_opens += st->vma_opens;
+		sum.vma_closes += st->vma_closes;
+		sum.mapped_bytes += st->mapped_bytes;
+		sum.unmapped_bytes += st->unmapped_bytes;
+		sum.faults += st->faults;
+		sum.remap_ns += st->remap_ns;
+		for (i = 0; i < MMAP_STATS_ERRNOS; i++)
+			sum.mmap_errors[i] += st->mmap_errors[i];
+	}
+
+	seq_printf(m, "opens %lu\n", sum.opens);
+	seq_printf(m, "open_files %ld\n", (long)(sum.opens - sum.releases));
+	seq_printf(m, "mmaps %lu\n", sum.mmaps);
+	seq_printf(m, "active_mappings %ld\n",
+		   (long)(sum.vma_opens - sum.vma_closes));
+	seq_printf(m, "mapped_bytes %ld\n",
+		   (long)(sum.mapped_bytes - sum.unmapped_bytes));
+	seq_printf(m, "faults %lu\n", sum.faults);
+	seq_printf(m, "remap_ns %llu\n", sum.remap_ns);
+	for (i = 1; i < MMAP_STATS_ERRNOS; i++)
+		if (sum.mmap_errors[i])
+			seq_printf(m, "mmap_errno_%u%s %lu\n", i,
+				   i == MMAP_STATS_ERRNOS - 1 ? "+" : "",
+				   sum.mmap_errors[i]);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mmap_stats);
+
+/* sysfs attributes of the device */
+static ssize_t backend_order_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	unsigned int i;
+	int len = 0;
+
+	for (i = 0; i < ARRAY_SIZE(mmap_backends); i++) {
+		if (mmap_backends[i] == MMAP_ALLOC_BACKEND_CMA && !mmap_cma)
+			continue;
+		len += sysfs_emit_at(buf, len, "%s%s", len ? " " : "",
+				     mmap_backend_names[mmap_backends[i]]);
+	}
+	len += sysfs_emit_at(buf, len, "\n");
+	return len;
+}
+static DEVICE_ATTR_RO(backend_order);
+
+static ssize_t fallbacks_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%ld\n", atomic_long_read(&mmap_fallbacks));
+}
+static DEVICE_ATTR_RO(fallbacks);
+
+/* CPUs with a ring, with percpu_bufs */
+static ssize_t percpu_cpus_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return cpumap_print_to_pagebuf(true, buf, &mmap_percpu_mask);
+}
+static DEVICE_ATTR_RO(percpu_cpus);
+
+/* free and total bytes of the pool */
+static ssize_t pool_show(struct device *dev, struct device_attribute *attr,
+			 char *buf)
+{
+	unsigned long free_pages;
+
+	if (!mmap_pool.region)
+		return sysfs_emit(buf, "0 0\n");
+	spin_lock(&mmap_pool.lock);
+	free_pages = mmap_pool.free_pages;
+	spin_unlock(&mmap_pool.lock);
+	return sysfs_emit(buf, "%lu %zu\n", free_pages << PAGE_SHIFT,
+			  mmap_pool.region->size);
+}
+static DEVICE_ATTR_RO(pool);
+
+/*
+ * buffers kept for reuse: dirty and ready ones, and buffers zeroed and
+ * reused so far
+ */
+static ssize_t recycle_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	unsigned long ndirty, nready, bytes;
+
+	spin_lock(&mmap_recycle_lock);
+	ndirty = mmap_recycle_ndirty;
+	nready = mmap_recycle_nready;
+	bytes = mmap_recycle_bytes;
+	spin_unlock(&mmap_recycle_lock);
+	return sysfs_emit(buf, "%lu %lu %ld %ld %lu\n", ndirty, nready,
+			  atomic_long_read(&mmap_recycle_zeroed),
+			  atomic_long_read(&mmap_recycle_reused), bytes);
+}
+static DEVICE_ATTR_RO(recycle);
+
+/* 1 once the memory set up at load time is ready */
+static ssize_t ready_show(struct device *dev, struct device_attribute *attr,
+			  char *buf)
+{
+	return sysfs_emit(buf, "%d\n",
+			  completion_done(&mmap_setup_done) && !mmap_setup_ret);
+}
+static DEVICE_ATTR_RO(ready);
+
+static struct attribute *mmap_attrs[] = {
+	&dev_attr_backend_order.attr,
+	&dev_attr_fallbacks.attr,
+	&dev_attr_percpu_cpus.attr,
+	&dev_attr_pool.attr,
+	&dev_attr_recycle.attr,
+	&dev_attr_ready.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(mmap);
+
+#ifdef CONFIG_DMA_CMA
+/* cma_for_each_area() callback, looks for the area named by cma */
+static int mmap_find_cma(struct cma *area, void *data)
+{
+	if (strcmp(cma_get_name(area), cma))
+		return 0;
+	mmap_cma = area;
+	return 1;
+}
+#endif
+
+/* choose the CMA area and log the order of the backends */
+static void mmap_setup_backends(void)
+{
+	unsigned int i;
+
+#ifdef CONFIG_DMA_CMA
+	if (use_cma) {
+		if (cma)
+			cma_for_each_area(mmap_find_cma, NULL);
+		else
+			mmap_cma = dev_get_cma_area(mmap_device);
+		if (mmap_cma)
+			pr_info("using CMA area %s\n", cma_get_name(mmap_cma));
+		else
+			pr_warn("CMA area %s not found\n",
+				cma ? cma : "(default)");
+	}
+#endif
+	for (i = 0; i < ARRAY_SIZE(mmap_backends); i++)
+		if (mmap_backends[i] != MMAP_ALLOC_BACKEND_CMA || mmap_cma)
+			pr_info("backend %u: %s\n", i,
+				mmap_backend_names[mmap_backends[i]]);
+}
+
+/* allocate the region of the pool and make it a single free block */
+static int mmap_pool_setup(void)
+{
+	unsigned long npages = roundup_pow_of_two(PAGE_ALIGN(pool_size) >>
+						  PAGE_SHIFT);
+	unsigned int i;
+
+	spin_lock_init(&mmap_pool.lock);
+	for (i = 0; i < MMAP_POOL_ORDERS; i++)
+		INIT_LIST_HEAD(&mmap_pool.free_list[i]);
+	mmap_pool.blocks = kvcalloc(npages, sizeof(*mmap_pool.blocks),
+				    GFP_KERNEL);
+	if (!mmap_pool.blocks)
+		return -ENOMEM;
+	mmap_pool.region = mmap_buf_alloc(npages << PAGE_SHIFT,
+					  MMAP_BUF_F_PAGES, buf_node);
+	if (!mmap_pool.region) {
+		kvfree(mmap_pool.blocks);
+		return -ENOMEM;
+	}
+	mmap_pool.max_order = ilog2(npages);
+	mmap_pool.free_pages = npages;
+	mmap_pool_add(0, mmap_pool.max_order);
+	return 0;
+}
+
+/*
+ * free the region of the pool; the buffers carved from it pin the module,
+ * so none of them is left
+ */
+static void mmap_pool_cleanup(void)
+{
+	mmap_buf_put(mmap_pool.region);
+	mmap_pool.region = NULL;
+	kvfree(mmap_pool.blocks);
+}
+
+/*
+ * CPU hotplug callback, allocates the ring of a CPU coming up on its node.
+ * A failure only leaves the CPU without a ring, it does not prevent it
+ * from coming up.
+ */
+static int mmap_percpu_prepare(unsigned int cpu)
+{
+	struct mmap_buf *buf;
+
+	/* the ring is kept while the CPU is offline */
+	if (per_cpu(mmap_percpu_buf, cpu))
+		return 0;
+
+	buf = mmap_buf_alloc(buf_size, MMAP_ALLOC_F_CACHED, cpu_to_node(cpu));
+	if (!buf)
+		goto out_err;
+	if (mmap_buf_init_ring(buf) < 0) {
+		mmap_buf_put(buf);
+		goto out_err;
+	}
+	/* the ring must be initialized before it can be seen */
+	smp_store_release(per_cpu_ptr(&mmap_percpu_buf, cpu), buf);
+	cpumask_set_cpu(cpu, &mmap_percpu_mask);
+	return 0;
+
+  out_err:
+	pr_err("cannot allocate the ring of CPU %u\n", cpu);
+	return 0;
+}
+
+/* stop allocating rings and free all of them */
+static void mmap_percpu_cleanup(void)
+{
+	unsigned int cpu;
+
+	cpuhp_remove_state_nocalls(mmap_percpu_state);
+	for_each_possible_cpu(cpu) {
+		if (per_cpu(mmap_percpu_buf, cpu))
+			mmap_buf_put(per_cpu(mmap_percpu_buf, cpu));
+		per_cpu(mmap_percpu_buf, cpu) = NULL;
+	}
+	cpumask_clear(&mmap_percpu_mask);
+}
+
+/* allocate the memory set up at load time */
+static int mmap_setup_bufs(void)
+{
+	struct mmap_buf **bufs;
+	unsigned int i;
+	int ret;
+
+	if (pool_size && (ret = mmap_pool_setup()) < 0) {
+		pr_err("could not allocate the pool\n");
+		goto out;
+	}
+	if (!private_bufs) {
+		bufs = kcalloc(nr_bufs, sizeof(*bufs), GFP_KERNEL);
+		if (!bufs) {
+			ret = -ENOMEM;
+			goto out_pool;
+		}
+		for (i = 0; i < nr_bufs; i++) {
+			bufs[i] = mmap_alloc_default_buf();
+			if (!bufs[i]) {
+				mmap_put_bufs(bufs, i);
+				ret = -ENOMEM;
+				goto out_pool;
+			}
+		}
+		/* pairs with mmap_alloc_ring_get() */
+		smp_store_release(&mmap_bufs, bufs);
+	}
+	if (percpu_bufs) {
+		/* allocates the rings of the online CPUs right away */
+		ret = cpuhp_setup_state(CPUHP_BP_PREPARE_DYN,
+					"mmap_alloc:percpu",
+					mmap_percpu_prepare, NULL);
+		if (ret < 0) {
+			pr_err("could not set up the per-CPU rings\n");
+			goto out_bufs;
+		}
+		mmap_percpu_state = ret;
+	}
+	return 0;
+
+  out_bufs:
+	if (!private_bufs) {
+		mmap_put_bufs(mmap_bufs, nr_bufs);
+		mmap_bufs = NULL;
+	}
+  out_pool:
+	if (pool_size)
+		mmap_pool_cleanup();
+	mmap_recycle_cleanup();
+  out:
+	return ret;
+}
+
+/* free the memory set up at load time */
+static void mmap_cleanup_bufs(void)
+{
+	if (percpu_bufs)
+		mmap_percpu_cleanup();
+	if (!private_bufs)
+		mmap_put_bufs(mmap_bufs, nr_bufs);
+	if (pool_size)
+		mmap_pool_cleanup();
+	mmap_recycle_cleanup();
+}
+
+static void mmap_setup_work_fn(struct work_struct *work)
+{
+	mmap_setup_ret = mmap_setup_bufs();
+	if (mmap_setup_ret < 0)
+		pr_err("deferred allocation failed (%d)\n", mmap_setup_ret);
+	else
+		pr_info("ready\n");
+	complete_all(&mmap_setup_done);
+}
+static DECLARE_WORK(mmap_setup_work, mmap_setup_work_fn);
+
+/*
+ * wait for the memory set up at load time and free it, if it was
+ * allocated
+ */
+static void mmap_teardown_bufs(void)
+{
+	flush_work(&mmap_setup_work);
+	if (!mmap_setup_ret)
+		mmap_cleanup_bufs();
+}
+
+/* module initialization - called at module load time */
+static int __init mmap_alloc_init(void)
+{
+        int ret = 0;
+
+	if (buf_node != NUMA_NO_NODE &&
+	    (buf_node < 0 || buf_node >= MAX_NUMNODES || !node_online(buf_node))) {
+		pr_err("invalid buf_node %d\n", buf_node);
+		return -EINVAL;
+	}
+
+	buf_size = PAGE_ALIGN(buf_size);
+	if (!buf_size || buf_size > MMAP_ALLOC_MAX_SIZE || !nr_bufs ||
+	    nr_bufs > MMAP_ALLOC_PERCPU_ID ||
+	    (percpu_bufs && (u64)nr_cpu_ids * buf_size > MMAP_ALLOC_MAX_SIZE) ||
+	    pool_size > MMAP_ALLOC_MAX_SIZE) {
+		pr_err("invalid buf_size, nr_bufs or pool_size\n");
+		return -EINVAL;
+	}
+
+        /* get the major number of the character device */
+        if ((ret = alloc_chrdev_region(&mmap_dev, 0, 1, "mmap_alloc")) < 0) {
+                pr_err("could not allocate major number for mmap\n");
+                goto out;
+        }
+
+	/* create the device used for the DMA API; udev creates the special
+	 * file /dev/mmap_alloc as well */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+	mmap_class = class_create("mmap_alloc");
+#else
+	mmap_class = class_create(THIS_MODULE, "mmap_alloc");
+#endif
+	if (IS_ERR(mmap_class)) {
+		ret = PTR_ERR(mmap_class);
+		pr_err("could not create class\n");
+		goto out_unalloc_region;
+	}
+	mmap_device = device_create_with_groups(mmap_class, NULL, mmap_dev,
+						NULL, mmap_groups,
+						"mmap_alloc");
+	if (IS_ERR(mmap_device)) {
+		ret = PTR_ERR(mmap_device);
+		pr_err("could not create device\n");
+		goto out_class;
+	}
+	mmap_device->dma_mask = &mmap_device->coherent_dma_mask;
+	if ((ret = dma_set_mask_and_coherent(mmap_device,
+					     DMA_BIT_MASK(64))) < 0) {
+		pr_err("could not set the DMA mask\n");
+		goto out_device;
+	}
+
+	mmap_setup_backends();
+	if (async_init) {
+		/* the openers wait for the allocations */
+		queue_work(system_unbound_wq, &mmap_setup_work);
+	} else {
+		if ((ret = mmap_setup_bufs()) < 0)
+			goto out_device;
+		complete_all(&mmap_setup_done);
+	}
+
+	/* statistics, nothing to do if debugfs is not available */
+	mmap_debugfs = debugfs_create_dir("mmap_alloc", NULL);
+	debugfs_create_file("stats", 0444, mmap_debugfs, NULL,
+			    &mmap_stats_fops);
+
+        /* initialize the device structure and register the device with the
+	 * kernel */
+        cdev_init(&mmap_cdev, &mmap_fops);
+        if ((ret = cdev_add(&mmap_cdev, mmap_dev, 1)) < 0) {
+                pr_err("could not allocate chrdev for mmap\n");
+                goto out_bufs;
+        }
+
+        return 0;
+        
+  out_bufs:
+	debugfs_remove_recursive(mmap_debugfs);
+	mmap_teardown_bufs();
+  out_device:
+	device_destroy(mmap_class, mmap_dev);
+  out_class:
+	class_destroy(mmap_class);
+  out_unalloc_region:
+        unregister_chrdev_region(mmap_dev, 1);
+  out:
+        return ret;
+}
+
+/* module unload */
+static void __exit mmap_alloc_exit(void)
+{
+        /* remove the character deivce */
+        cdev_del(&mmap_cdev);
+	debugfs_remove_recursive(mmap_debugfs);
+
+	/* free the memory areas */
+	mmap_teardown_bufs();
+
+	device_destroy(mmap_class, mmap_dev);
+	class_destroy(mmap_class);
+        unregister_chrdev_region(mmap_dev, 1);
+}
+
+module_init(mmap_alloc_init);
+module_exit(mmap_alloc_exit);
+MODULE_DESCRIPTION("mmap_alloc driver");
+MODULE_AUTHOR("Claudio Scordino and Bruno Morelli");
+MODULE_LICENSE("GPL");
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+MODULE_IMPORT_NS("DMA_BUF");
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
 
@@ -0,0 +1,278 @@
+#ifndef _MMAP_ALLOC_H
+#define _MMAP_ALLOC_H
+
+/*
+ * User-space interface of the mmap_alloc driver.
+ * This header is shared by the driver and by the user-space programs.
+ *
+ * Authors: Claudio Scordino, Bruno Morelli
+ */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Layout of the mmap offset: the id of the buffer is stored above the offset
+ * within the buffer, so that each buffer can be up to 64 GiB.
+ * The buffers allocated at open time have ids 0 .. nr_bufs - 1.
+ */
+#define MMAP_ALLOC_ID_SHIFT	36
+#define MMAP_ALLOC_ID_BITS	20
+#define MMAP_ALLOC_MAX_SIZE	(1ULL << MMAP_ALLOC_ID_SHIFT)
+
+/* mmap offset of the buffer with the given id */
+#define MMAP_ALLOC_OFFSET(id)	((__u64)(id) << MMAP_ALLOC_ID_SHIFT)
+
+/*
+ * With the percpu_bufs module parameter, the last id maps the rings (see
+ * mmap_alloc_ring.h) of all the CPUs: the ring of CPU n starts at offset
+ * n * buf_size of the mapping, where buf_size is the module parameter. The
+ * CPUs that have a ring are listed in
+ * /sys/class/mmap_alloc/mmap_alloc/percpu_cpus; touching the slot of any
+ * other CPU raises SIGBUS. Kernel producers append to the ring of their
+ * CPU with mmap_alloc_percpu_enqueue() and a consumer sweeps all of them.
+ */
+#define MMAP_ALLOC_PERCPU_ID	((1U << MMAP_ALLOC_ID_BITS) - 1)
+#define MMAP_ALLOC_PERCPU_OFFSET MMAP_ALLOC_OFFSET(MMAP_ALLOC_PERCPU_ID)
+
+/*
+ * The buffers can only be mapped with MAP_SHARED (or MAP_PRIVATE without
+ * write access to the file), as copy-on-write mappings are refused.
+ *
+ * The bits above the id select how the mapping is set up, e.g.
+ *
+ *	mmap(0, size, prot, MAP_SHARED, fd,
+ *	     info.offset | MMAP_ALLOC_MODE(MMAP_ALLOC_MAP_WC));
+ */
+#define MMAP_ALLOC_MODE_SHIFT	(MMAP_ALLOC_ID_SHIFT + MMAP_ALLOC_ID_BITS)
+#define MMAP_ALLOC_MODE_BITS	4
+#define MMAP_ALLOC_MODE(mode)	((__u64)(mode) << MMAP_ALLOC_MODE_SHIFT)
+
+/*
+ * the attributes of the kernel mapping of the buffer: dma_mmap_coherent()
+ * for the coherent backend, the only mode it accepts, cached for the
+ * MMAP_ALLOC_F_CACHED buffers and non-cached otherwise
+ */
+#define MMAP_ALLOC_MAP_DEFAULT		0
+/* non-cached: every access goes to memory */
+#define MMAP_ALLOC_MAP_NONCACHED	1
+/*
+ * write-combining: stores are buffered and merged before reaching memory,
+ * so streaming writes run close to memory bandwidth. Reads are not cached.
+ * Issue a store fence (e.g. __sync_synchronize()) before telling a device
+ * that the data is ready. Only for buffers allocated with MMAP_ALLOC_F_WC.
+ */
+#define MMAP_ALLOC_MAP_WC		2
+/* cached: only for buffers allocated with MMAP_ALLOC_F_CACHED */
+#define MMAP_ALLOC_MAP_CACHED		3
+
+/*
+ * The bits above the mode are flags of the mapping, to be ORed into the
+ * mmap offset.
+ */
+#define MMAP_ALLOC_MAP_F_SHIFT	(MMAP_ALLOC_MODE_SHIFT + MMAP_ALLOC_MODE_BITS)
+#define MMAP_ALLOC_MAP_F_BITS	3
+/*
+ * Lazy mapping: nothing is mapped by mmap(), the pages are mapped when
+ * first touched, together with their neighbours, so that mapping a large
+ * buffer is quick and sequential scans take one fault every 64 KiB.
+ * Not for the coherent backend.
+ */
+#define MMAP_ALLOC_MAP_F_LAZY	(1ULL << MMAP_ALLOC_MAP_F_SHIFT)
+/*
+ * Prefaulted mapping: the whole range is populated by mmap(), so that no
+ * page fault is ever taken on it. Cached mappings of buffers backed by
+ * struct pages (see MMAP_ALLOC_BACKEND_*) are populated in batches with
+ * vm_insert_pages(), which also makes them usable for direct I/O; the other
+ * ones with a single remap_pfn_range(). The time spent is accumulated in the
+ * prefault_ns field. Not valid for huge buffers or with MMAP_ALLOC_MAP_F_LAZY.
+ */
+#define MMAP_ALLOC_MAP_F_PREFAULT (2ULL << MMAP_ALLOC_MAP_F_SHIFT)
+
+/* flags of mmap_alloc_buf */
+/*
+ * Cached buffer, mapped with the streaming DMA API. The CPU reads and writes
+ * it at cached speed, but ownership has to be passed explicitly: call
+ * SYNC_FOR_CPU before reading data written by a device, and SYNC_FOR_DEVICE
+ * after writing data that a device will read. Taken from the CMA area if
+ * any, otherwise limited to the largest allocation of the page allocator.
+ */
+#define MMAP_ALLOC_F_CACHED		(1U << 0)
+/*
+ * Huge buffer: the size is rounded up to 2 MiB and the mappings are
+ * populated at fault time with PMD entries (one TLB entry per 2 MiB) where
+ * the alignment of the physical and virtual addresses allows it, falling
+ * back to 4 KiB pages elsewhere. Needs transparent huge pages enabled
+ * (always or madvise) in /sys/kernel/mm/transparent_hugepage/enabled.
+ * The huge_maps and page_maps fields tell how the buffer has been mapped.
+ */
+#define MMAP_ALLOC_F_HUGE		(1U << 1)
+/*
+ * Allocate on the NUMA node given in the node field, falling back to the
+ * other nodes if it has no memory left. Without this flag the memory comes
+ * from the node of the caller.
+ */
+#define MMAP_ALLOC_F_NODE		(1U << 2)
+/*
+ * Carve the buffer out of the region reserved at load time with the
+ * pool_size module parameter, in a time bounded by the number of orders of
+ * the pool and without fragmenting physical memory. The size is rounded up
+ * to a power of two pages and the backend is the one of the region. Not
+ * valid with the other flags. The free and total bytes of the pool are in
+ * /sys/class/mmap_alloc/mmap_alloc/pool.
+ */
+#define MMAP_ALLOC_F_POOL		(1U << 3)
+/*
+ * Write-combining buffer: the kernel maps it write-combining too, so that
+ * the user mappings get the type they ask for (x86 with PAT would make them
+ * write-back otherwise). Not valid with MMAP_ALLOC_F_CACHED.
+ */
+#define MMAP_ALLOC_F_WC			(1U << 4)
+
+/*
+ * Where the memory of a buffer comes from. The allocations try, in order, a
+ * CMA area, dma_alloc_coherent() (not for cached, write-combining or huge
+ * buffers) and the page allocator. The actual order is in
+ * /sys/class/mmap_alloc/mmap_alloc/backend_order and the number of
+ * allocations that fell back past the first backend in .../fallbacks.
+ */
+#define MMAP_ALLOC_BACKEND_COHERENT	0
+#define MMAP_ALLOC_BACKEND_CMA		1
+#define MMAP_ALLOC_BACKEND_PAGES	2
+
+/* description of a buffer, used by ALLOC and QUERY */
+struct mmap_alloc_buf {
+	__u32 id;		/* ALLOC: out, QUERY: in */
+	__u32 flags;		/* MMAP_ALLOC_F_* */
+	__u32 backend;		/* out: MMAP_ALLOC_BACKEND_* */
+	__s32 node;		/* in: with MMAP_ALLOC_F_NODE, out: actual node */
+	__u64 size;		/* ALLOC: in, rounded up to a page */
+	/* both 0 without CAP_SYS_RAWIO */
+	__u64 dma_addr;		/* bus address, as seen by the devices */
+	__u64 phys_addr;	/* physical address, 0 for the coherent backend */
+	__u64 offset;		/* cookie to pass as mmap offset */
+	__u64 huge_maps;	/* PMD entries installed by faults */
+	__u64 page_maps;	/* PTE entries installed by faults */
+	__u64 prefaults;	/* mappings created with MMAP_ALLOC_MAP_F_PREFAULT */
+	__u64 prefault_ns;	/* time spent populating them */
+};
+
+/* range of a buffer, used by the SYNC ioctls */
+struct mmap_alloc_sync {
+	__u32 id;
+	__u32 pad;
+	__u64 offset;		/* in bytes from the start of the buffer */
+	__u64 length;		/* in bytes */
+};
+
+/*
+ * eventfd bound to a buffer by the DOORBELL ioctl. The eventfd is signalled
+ * once records records, or records for a total of bytes bytes, have been
+ * produced in the buffer since the last signal; a watermark of 0 is
+ * disabled and with both of them 0 every record is signalled. The records
+ * are the ones appended to the ring of the buffer (counted with their header
+ * and padding), the ones declared by PUBLISH_DATA, and PUBLISH, which counts
+ * as a record of 0 bytes.
+ */
+struct mmap_alloc_doorbell {
+	__u32 id;
+	__s32 fd;		/* eventfd, negative to unbind */
+	__u64 bytes;
+	__u32 records;
+	__u32 pad;
+};
+
+/* data produced in a buffer by user space, declared by PUBLISH_DATA */
+struct mmap_alloc_publish {
+	__u32 id;
+	__u32 records;
+	__u64 bytes;
+};
+
+/* buffer exported by the EXPORT ioctl */
+struct mmap_alloc_export {
+	__u32 id;
+	__u32 flags;		/* in: 0 or O_CLOEXEC */
+	__s32 fd;		/* out: dma-buf file descriptor */
+	__u32 pad;
+};
+
+/* slab created by the SLAB_CREATE ioctl, see mmap_alloc_slab.h */
+struct mmap_alloc_slab_create {
+	__u32 obj_size;		/* in: bytes per object */
+	__u32 count;		/* in: number of objects */
+	__u32 flags;		/* in: 0 */
+	__u32 id;		/* out: id of the buffer */
+	__u64 size;		/* out: size of the buffer */
+	__u64 offset;		/* out: cookie to pass as mmap offset */
+};
+
+#define MMAP_ALLOC_IOC_MAGIC	'M'
+
+/* allocate a new buffer of the given size */
+#define MMAP_ALLOC_IOC_ALLOC	_IOWR(MMAP_ALLOC_IOC_MAGIC, 0, \
+				      struct mmap_alloc_buf)
+/* free the buffer with the given id; existing mappings stay valid */
+#define MMAP_ALLOC_IOC_FREE	_IOW(MMAP_ALLOC_IOC_MAGIC, 1, __u32)
+/* get the description of the buffer with the given id */
+#define MMAP_ALLOC_IOC_QUERY	_IOWR(MMAP_ALLOC_IOC_MAGIC, 2, \
+				      struct mmap_alloc_buf)
+/* give a range of a cached buffer to the CPU (invalidate) */
+#define MMAP_ALLOC_IOC_SYNC_FOR_CPU	_IOW(MMAP_ALLOC_IOC_MAGIC, 3, \
+					     struct mmap_alloc_sync)
+/* give a range of a cached buffer to the devices (write back) */
+#define MMAP_ALLOC_IOC_SYNC_FOR_DEVICE	_IOW(MMAP_ALLOC_IOC_MAGIC, 4, \
+					     struct mmap_alloc_sync)
+
+/*
+ * select the buffer with the given id as the one watched by poll() and
+ * epoll on this file, and mark its data as seen. The file becomes readable
+ * when the buffer is published again or, if the buffer holds a ring (see
+ * mmap_alloc_ring.h), while the ring holds records not consumed yet; PUBLISH
+ * then only wakes the readers up. Once a buffer is watched, only the same id
+ * is accepted: call WATCH again with it after handling the data, except for
+ * rings, which need no re-arming.
+ */
+#define MMAP_ALLOC_IOC_WATCH	_IOW(MMAP_ALLOC_IOC_MAGIC, 5, __u32)
+/* wake up the readers watching the buffer with the given id */
+#define MMAP_ALLOC_IOC_PUBLISH	_IOW(MMAP_ALLOC_IOC_MAGIC, 6, __u32)
+
+/*
+ * bind an eventfd to a buffer, so that a single epoll or io_uring loop can
+ * wait for many buffers with coalesced wakeups. Each file binds at most one
+ * eventfd per buffer: binding again replaces it. The binding goes away when
+ * the file is closed.
+ */
+#define MMAP_ALLOC_IOC_DOORBELL	_IOW(MMAP_ALLOC_IOC_MAGIC, 7, \
+				     struct mmap_alloc_doorbell)
+
+/*
+ * export a buffer as a dma-buf, to pass it to other processes (e.g. over a
+ * UNIX socket) or to other drivers (e.g. V4L2 with V4L2_MEMORY_DMABUF)
+ * without copies. The dma-buf keeps the buffer alive after FREE and after
+ * the file is closed. mmap() of the dma-buf maps the whole buffer, cached
+ * for cached buffers; bracket the CPU accesses with DMA_BUF_IOCTL_SYNC,
+ * which hands cached buffers over like the SYNC ioctls.
+ */
+#define MMAP_ALLOC_IOC_EXPORT	_IOWR(MMAP_ALLOC_IOC_MAGIC, 8, \
+				      struct mmap_alloc_export)
+
+/*
+ * allocate a cached buffer holding a slab of equally sized objects with a
+ * free list shared with user space (see mmap_alloc_slab.h): map it once,
+ * then get and put objects with a single atomic operation each. The objects
+ * start at page aligned data_offset and are cache line aligned, or page
+ * aligned if at least a page large. FREE releases the whole slab.
+ */
+#define MMAP_ALLOC_IOC_SLAB_CREATE	_IOWR(MMAP_ALLOC_IOC_MAGIC, 9, \
+					      struct mmap_alloc_slab_create)
+
+/*
+ * like PUBLISH, also accounting the given records and bytes to the
+ * doorbells of the buffer, so that user-space producers can use the byte
+ * watermark
+ */
+#define MMAP_ALLOC_IOC_PUBLISH_DATA	_IOW(MMAP_ALLOC_IOC_MAGIC, 10, \
+					     struct mmap_alloc_publish)
+
+#endif /* _MMAP_ALLOC_H */
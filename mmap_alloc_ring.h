@@ -0,0 +1,162 @@
+#ifndef _MMAP_ALLOC_RING_H
+#define _MMAP_ALLOC_RING_H
+
+/*
+ * Single-producer single-consumer ring of variable-length records, laid out
+ * at the start of a buffer of the mmap_alloc driver.
+ *
+ * The header is followed by the data area. head and tail are free-running
+ * byte counters, reduced modulo capacity to address the data area; the
+ * producer only writes head and seq, the consumer only writes tail, and
+ * each of them sits on its own cache line so the two sides never contend.
+ * Records never wrap around the end of the data area: when a record does
+ * not fit, the producer fills the end with a padding record and starts over
+ * at offset 0.
+ *
+ * The producer is in the kernel (see mmap_alloc_ring_enqueue()); this header
+ * also provides the user-space consumer, which can sleep in poll() on the
+ * file the buffer has been mapped from when the ring is empty.
+ *
+ * Authors: Claudio Scordino, Bruno Morelli
+ */
+
+#include <linux/types.h>
+
+#define MMAP_ALLOC_RING_MAGIC		0x474e4952	/* "RING" */
+#define MMAP_ALLOC_RING_VERSION		1
+#define MMAP_ALLOC_RING_CACHELINE	64
+
+struct mmap_alloc_ring {
+	/* set by the producer at initialization, read-only afterwards */
+	__u32 magic;
+	__u32 version;
+	__u64 capacity;		/* size of the data area, multiple of 8 */
+	__u64 data_offset;	/* offset of the data area from the header */
+	__u8 pad0[MMAP_ALLOC_RING_CACHELINE - 24];
+
+	/* written by the producer */
+	__u64 head;		/* bytes produced */
+	__u64 seq;		/* records produced */
+	__u8 pad1[MMAP_ALLOC_RING_CACHELINE - 16];
+
+	/* written by the consumer */
+	__u64 tail;		/* bytes consumed */
+	__u8 pad2[MMAP_ALLOC_RING_CACHELINE - 8];
+};
+
+/* record header, followed by len bytes of payload padded to 8 bytes */
+struct mmap_alloc_ring_rec {
+	__u32 len;
+	__u32 flags;
+};
+
+/* the record only fills the end of the data area */
+#define MMAP_ALLOC_RING_REC_PAD		(1U << 0)
+
+/* bytes taken in the data area by a record with len bytes of payload */
+#define MMAP_ALLOC_RING_REC_SIZE(len) \
+	(sizeof(struct mmap_alloc_ring_rec) + (((__u64)(len) + 7) & ~7ULL))
+
+#ifdef __KERNEL__
+
+/* kernel-side producer of a ring */
+struct mmap_ring;
+
+struct mmap_ring *mmap_alloc_ring_get(unsigned int index);
+int mmap_alloc_ring_enqueue(struct mmap_ring *ring, const void *data,
+			    u32 len);
+int mmap_alloc_percpu_enqueue(const void *data, u32 len);
+
+#else /* !__KERNEL__ */
+
+/* upper bound of the spin budget of mmap_alloc_ring_wait() */
+#define MMAP_ALLOC_RING_MAX_SPINS	(1U << 16)
+
+#include <stddef.h>
+#include <errno.h>
+#include <poll.h>
+
+/* check that a mapped buffer holds a ring */
+static inline int mmap_alloc_ring_valid(const struct mmap_alloc_ring *r)
+{
+	return r->magic == MMAP_ALLOC_RING_MAGIC &&
+	    r->version == MMAP_ALLOC_RING_VERSION;
+}
+
+/* address of the record at the given position */
+static inline struct mmap_alloc_ring_rec *
+mmap_alloc_ring_rec(struct mmap_alloc_ring *r, __u64 pos)
+{
+	return (struct mmap_alloc_ring_rec *)((char *)r + r->data_offset +
+	    pos % r->capacity);
+}
+
+/*
+ * Return the payload of the oldest record and store its length in len, or
+ * return NULL if the ring is empty. The record stays in the ring until
+ * mmap_alloc_ring_consume() is called.
+ */
+static inline const void *mmap_alloc_ring_peek(struct mmap_alloc_ring *r,
+    __u32 *len)
+{
+	__u64 tail = r->tail;
+	/* pairs with the release store of head by the producer */
+	__u64 head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	struct mmap_alloc_ring_rec *rec;
+
+	while (tail != head) {
+		rec = mmap_alloc_ring_rec(r, tail);
+		if (!(rec->flags & MMAP_ALLOC_RING_REC_PAD)) {
+			*len = rec->len;
+			return rec + 1;
+		}
+		/* skip the padding up to the end of the data area */
+		tail += r->capacity - tail % r->capacity;
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/* release the record returned by mmap_alloc_ring_peek() */
+static inline void mmap_alloc_ring_consume(struct mmap_alloc_ring *r)
+{
+	__u64 tail = r->tail;
+
+	tail += MMAP_ALLOC_RING_REC_SIZE(mmap_alloc_ring_rec(r, tail)->len);
+	/* the producer may reuse the space once it sees the new tail */
+	__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Wait for a record and return it like mmap_alloc_ring_peek(), or return
+ * NULL if poll() fails. fd is the file the buffer has been mapped from,
+ * watching the buffer (see MMAP_ALLOC_IOC_WATCH).
+ * The ring is polled in memory for up to *spins rounds before sleeping in
+ * poll(); *spins adapts to the traffic, doubling when a record arrives while
+ * spinning and halving when the caller has to sleep, so busy consumers
+ * never make a system call and idle ones do not burn a core.
+ */
+static inline const void *mmap_alloc_ring_wait(struct mmap_alloc_ring *r,
+    int fd, unsigned int *spins, __u32 *len)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	const void *rec;
+	unsigned int i;
+
+	for (;;) {
+		for (i = 0; i <= *spins; i++) {
+			if ((rec = mmap_alloc_ring_peek(r, len)) != NULL) {
+				if (i > 0 && *spins < MMAP_ALLOC_RING_MAX_SPINS)
+					*spins = *spins ? *spins * 2 : 1;
+				return rec;
+			}
+		}
+		*spins /= 2;
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			return NULL;
+	}
+}
+
+#endif /* __KERNEL__ */
+
+#endif /* _MMAP_ALLOC_RING_H */
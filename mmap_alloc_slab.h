@@ -0,0 +1,101 @@
+#ifndef _MMAP_ALLOC_SLAB_H
+#define _MMAP_ALLOC_SLAB_H
+
+/*
+ * Slab of equally sized objects, created in a buffer of the mmap_alloc
+ * driver by the SLAB_CREATE ioctl (see mmap_alloc.h).
+ *
+ * The header is followed by the array of the free list links and by the
+ * objects. The free list is a stack of object indices threaded through the
+ * links; its head carries a tag incremented by every operation, so that a
+ * single compare-and-swap pops or pushes an object without ABA problems.
+ * The whole slab is mapped once: getting and putting an object never makes
+ * a system call nor changes a page table, and the processes sharing the
+ * buffer (e.g. through a dma-buf) share the slab.
+ *
+ * Authors: Claudio Scordino, Bruno Morelli
+ */
+
+#include <linux/types.h>
+
+#define MMAP_ALLOC_SLAB_MAGIC		0x42414c53	/* "SLAB" */
+#define MMAP_ALLOC_SLAB_VERSION		1
+#define MMAP_ALLOC_SLAB_CACHELINE	64
+
+/* end of the free list */
+#define MMAP_ALLOC_SLAB_NIL		0xffffffffU
+
+struct mmap_alloc_slab {
+	/* set at creation, read-only afterwards */
+	__u32 magic;
+	__u32 version;
+	__u32 obj_size;
+	__u32 count;
+	__u64 stride;		/* distance between two objects */
+	__u64 next_offset;	/* offset of __u32 next[count] */
+	__u64 data_offset;	/* offset of object 0, page aligned */
+	__u8 pad0[MMAP_ALLOC_SLAB_CACHELINE - 40];
+
+	/* (tag << 32) | index of the first free object */
+	__u64 head;
+	__u8 pad1[MMAP_ALLOC_SLAB_CACHELINE - 8];
+};
+
+#ifndef __KERNEL__
+
+/* check that a mapped buffer holds a slab */
+static inline int mmap_alloc_slab_valid(const struct mmap_alloc_slab *s)
+{
+	return s->magic == MMAP_ALLOC_SLAB_MAGIC &&
+	    s->version == MMAP_ALLOC_SLAB_VERSION;
+}
+
+static inline __u32 *mmap_alloc_slab_next(struct mmap_alloc_slab *s)
+{
+	return (__u32 *)((char *)s + s->next_offset);
+}
+
+/* address of an object */
+static inline void *mmap_alloc_slab_obj(struct mmap_alloc_slab *s, __u32 i)
+{
+	return (char *)s + s->data_offset + i * s->stride;
+}
+
+/* pop a free object and return its index, or -1 if the slab is full */
+static inline long long mmap_alloc_slab_get(struct mmap_alloc_slab *s)
+{
+	__u32 *next = mmap_alloc_slab_next(s);
+	__u64 old = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+	__u64 new;
+	__u32 i;
+
+	do {
+		i = (__u32)old;
+		if (i == MMAP_ALLOC_SLAB_NIL)
+			return -1;
+		/* next[i] may be stale if i was popped meanwhile: the tag
+		 * makes the compare-and-swap fail in that case */
+		new = (((old >> 32) + 1) << 32) |
+		    __atomic_load_n(&next[i], __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&s->head, &old, new, 1,
+	    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	return i;
+}
+
+/* push back an object returned by mmap_alloc_slab_get() */
+static inline void mmap_alloc_slab_put(struct mmap_alloc_slab *s, __u32 i)
+{
+	__u32 *next = mmap_alloc_slab_next(s);
+	__u64 old = __atomic_load_n(&s->head, __ATOMIC_RELAXED);
+	__u64 new;
+
+	do {
+		__atomic_store_n(&next[i], (__u32)old, __ATOMIC_RELAXED);
+		new = (((old >> 32) + 1) << 32) | i;
+	} while (!__atomic_compare_exchange_n(&s->head, &old, new, 1,
+	    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+#endif /* __KERNEL__ */
+
+#endif /* _MMAP_ALLOC_SLAB_H */
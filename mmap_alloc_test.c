@@ -1,3 +1,4 @@
+#define _GNU_SOURCE	/* splice() */
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/mman.h>
@@ -5,8 +6,20 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <linux/dma-buf.h>
+#include <sys/uio.h>
 
-#define NPAGES 16
+#include "mmap_alloc.h"
+#include "mmap_alloc_ring.h"
+#include "mmap_alloc_slab.h"
+
+#define PARAM_DIR "/sys/module/mmap_alloc/parameters/"
+#define DEVICE_DIR "/sys/class/mmap_alloc/mmap_alloc/"
 
 /*
  * Program to test mmap_alloc driver.
@@ -23,43 +36,782 @@
  * 2. Create the special file (assuming major number 254)
  *
  *	mknod /dev/mmap_alloc c 254 0
+ *
+ * The number of the buffers is read from the module parameters exported in
+ * sysfs, their size and mmap offset are obtained through the QUERY ioctl.
 */
 
-int main(void)
+/* read an unsigned integer module parameter from sysfs */
+static unsigned long read_param(const char *name)
 {
-	int fd;
-	unsigned int *kadr;
+	char path[128];
+	unsigned long val;
+	FILE *f;
 
-	int len = NPAGES * getpagesize();
+	snprintf(path, sizeof(path), PARAM_DIR "%s", name);
+	if ((f = fopen(path, "r")) == NULL) {
+		perror(path);
+		exit(-1);
+	}
+	if (fscanf(f, "%lu", &val) != 1) {
+		fprintf(stderr, "mmap_alloc: cannot parse %s\n", path);
+		exit(-1);
+	}
+	fclose(f);
+	return val;
+}
 
-	if ((fd=open("/dev/mmap_alloc", O_RDWR|O_SYNC)) < 0) {
-		perror("open");
+/* read a boolean module parameter from sysfs */
+static int read_bool_param(const char *name)
+{
+	char path[128];
+	char val;
+	FILE *f;
+
+	snprintf(path, sizeof(path), PARAM_DIR "%s", name);
+	if ((f = fopen(path, "r")) == NULL) {
+		perror(path);
 		exit(-1);
 	}
-	fprintf(stderr, "mmap_alloc: open OK\n");
+	if (fscanf(f, " %c", &val) != 1) {
+		fprintf(stderr, "mmap_alloc: cannot parse %s\n", path);
+		exit(-1);
+	}
+	fclose(f);
+	return val == 'Y';
+}
+
+/* the buffers allocated at open hold the pattern, or a ring, or zeroes */
+static int pattern, ring_bufs;
+
+/* check the ring laid out by the driver and drain it */
+static int check_ring(struct mmap_alloc_ring *r, unsigned long len)
+{
+	__u32 n;
+
+	if (!mmap_alloc_ring_valid(r) || r->data_offset < sizeof(*r)
+	    || r->data_offset + r->capacity > len) {
+		fprintf(stderr, "mmap_alloc: ring check ERROR\n");
+		return -1;
+	}
+	while (mmap_alloc_ring_peek(r, &n) != NULL)
+		mmap_alloc_ring_consume(r);
+	fprintf(stderr, "mmap_alloc: ring check OK (capacity %llu)\n",
+	    (unsigned long long)r->capacity);
+	return 0;
+}
+
+/* map buffer i with the given mode and flags and check the pattern stored
+ * by the driver */
+static int check_buffer(int fd, unsigned int i, __u64 how)
+{
+	struct mmap_alloc_buf info;
+	unsigned int *kadr;
+	unsigned long len, n;
+
+	memset(&info, 0, sizeof(info));
+	info.id = i;
+	if (ioctl(fd, MMAP_ALLOC_IOC_QUERY, &info) < 0) {
+		perror("ioctl(QUERY)");
+		exit(-1);
+	}
+	len = info.size;
+	n = len / sizeof(int);
 
 	kadr = mmap(0, len, PROT_READ|PROT_WRITE, MAP_SHARED| MAP_LOCKED,
-	    fd, 0);
+	    fd, info.offset | how);
 
 	if (kadr == MAP_FAILED)	{
 		perror("mmap");
 		exit(-1);
 	}
-	fprintf(stderr, "mmap_alloc: mmap OK\n");
+	fprintf(stderr, "mmap_alloc: mmap of buffer %u (0x%llx) OK\n", i,
+	    (unsigned long long)how);
 
+	if (ring_bufs) {
+		int ret = check_ring((struct mmap_alloc_ring *)kadr, len);
+
+		munmap(kadr, len);
+		return ret;
+	}
+	if (!pattern) {
+		if (kadr[0] || kadr[1] || kadr[n - 2] || kadr[n - 1]) {
+			fprintf(stderr, "mmap_alloc: check ERROR (not zeroed)\n");
+			munmap(kadr, len);
+			return -1;
+		}
+		fprintf(stderr, "mmap_alloc: check OK\n");
+		munmap(kadr, len);
+		return 0;
+	}
 	if ((kadr[0]!=0xdead0000) || (kadr[1]!=0xbeef0000)
-	    || (kadr[len / sizeof(int) - 2] !=
-	        (0xdead0000 + len / sizeof(int) - 2))
-	    || (kadr[len / sizeof(int) - 1] !=
-	        (0xbeef0000 + len / sizeof(int) - 2))) {
+	    || (kadr[n - 2] != (0xdead0000 + n - 2))
+	    || (kadr[n - 1] != (0xbeef0000 + n - 2))) {
 		fprintf(stderr, "mmap_alloc: check ERROR\n");
 		fprintf(stderr, "0x%x 0x%x\n", kadr[0], kadr[1]);
-		fprintf(stderr, "0x%x 0x%x\n", kadr[len / sizeof(int) - 2],
-		    kadr[len / sizeof(int) - 1]);
+		fprintf(stderr, "0x%x 0x%x\n", kadr[n - 2], kadr[n - 1]);
+		munmap(kadr, len);
+		return -1;
+	}
+	fprintf(stderr, "mmap_alloc: check OK\n");
+	munmap(kadr, len);
+	return 0;
+}
+
+/* allocate a buffer at runtime, write it through a mapping set up as told
+ * by how and free it */
+static int check_alloc(int fd, unsigned long len, unsigned int flags,
+    __u64 how)
+{
+	struct mmap_alloc_buf info;
+	struct mmap_alloc_sync sync;
+	unsigned int *kadr;
+	unsigned long i;
+	int ret = 0;
+
+	memset(&info, 0, sizeof(info));
+	info.size = len;
+	info.flags = flags;
+	if (ioctl(fd, MMAP_ALLOC_IOC_ALLOC, &info) < 0) {
+		perror("ioctl(ALLOC)");
+		return -1;
+	}
+	fprintf(stderr, "mmap_alloc: alloc OK (id %u, dma 0x%llx, node %d)\n",
+	    info.id, (unsigned long long)info.dma_addr, info.node);
+
+	kadr = mmap(0, info.size, PROT_READ|PROT_WRITE, MAP_SHARED, fd,
+	    info.offset | how);
+	if (kadr == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	if (how & MMAP_ALLOC_MAP_F_PREFAULT) {
+		if (ioctl(fd, MMAP_ALLOC_IOC_QUERY, &info) < 0) {
+			perror("ioctl(QUERY)");
+			return -1;
+		}
+		fprintf(stderr, "mmap_alloc: prefault took %llu ns\n",
+		    (unsigned long long)info.prefault_ns);
+	}
+	for (i = 0; i < info.size / sizeof(int); i++)
+		kadr[i] = i;
+
+	/* hand the data to the devices and back (no-op if coherent) */
+	memset(&sync, 0, sizeof(sync));
+	sync.id = info.id;
+	sync.length = info.size;
+	if (ioctl(fd, MMAP_ALLOC_IOC_SYNC_FOR_DEVICE, &sync) < 0 ||
+	    ioctl(fd, MMAP_ALLOC_IOC_SYNC_FOR_CPU, &sync) < 0) {
+		perror("ioctl(SYNC)");
+		ret = -1;
+	}
+
+	/* the mapping must survive the free of the buffer */
+	if (ioctl(fd, MMAP_ALLOC_IOC_FREE, &info.id) < 0) {
+		perror("ioctl(FREE)");
+		ret = -1;
+	}
+	for (i = 0; i < info.size / sizeof(int); i++)
+		if (kadr[i] != i) {
+			fprintf(stderr, "mmap_alloc: alloc check ERROR\n");
+			ret = -1;
+			break;
+		}
+	munmap(kadr, info.size);
+	if (ioctl(fd, MMAP_ALLOC_IOC_QUERY, &info) == 0) {
+		fprintf(stderr, "mmap_alloc: freed buffer still present\n");
+		ret = -1;
+	}
+	if (!ret)
+		fprintf(stderr, "mmap_alloc: alloc check OK\n");
+	return ret;
+}
+
+/*
+ * check that private mappings, which would be copy-on-write, are refused
+ * whatever the backend of the buffer
+ */
+static int check_private(int fd, unsigned long len)
+{
+	struct mmap_alloc_buf info;
+	void *kadr;
+	int ret = 0;
+
+	memset(&info, 0, sizeof(info));
+	info.size = len;
+	if (ioctl(fd, MMAP_ALLOC_IOC_ALLOC, &info) < 0) {
+		perror("ioctl(ALLOC)");
+		return -1;
+	}
+	kadr = mmap(0, info.size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd,
+	    info.offset);
+	if (kadr != MAP_FAILED || errno != EINVAL) {
+		fprintf(stderr, "mmap_alloc: private check ERROR\n");
+		if (kadr != MAP_FAILED)
+			munmap(kadr, info.size);
+		ret = -1;
+	}
+	ioctl(fd, MMAP_ALLOC_IOC_FREE, &info.id);
+	if (!ret)
+		fprintf(stderr, "mmap_alloc: private check OK\n");
+	return ret;
+}
+
+/* map a huge buffer, touch it and report how it has been mapped */
+/*
+ * unmap the middle page of a mapping populated at fault time, splitting it
+ * in two, and use what is left
+ */
+static int check_split(int fd, unsigned long len)
+{
+	struct mmap_alloc_buf info;
+	unsigned long page = getpagesize();
+	char *kadr;
+	int ret = 0;
+
+	memset(&info, 0, sizeof(info));
+	info.size = len;
+	if (ioctl(fd, MMAP_ALLOC_IOC_ALLOC, &info) < 0) {
+		perror("ioctl(ALLOC)");
+		return -1;
+	}
+	kadr = mmap(0, info.size, PROT_READ|PROT_WRITE, MAP_SHARED, fd,
+	    info.offset | MMAP_ALLOC_MAP_F_LAZY);
+	if (kadr == MAP_FAILED) {
+		perror("mmap");
+		ioctl(fd, MMAP_ALLOC_IOC_FREE, &info.id);
+		return -1;
+	}
+	if (munmap(kadr + page, page) < 0) {
+		perror("munmap");
+		ret = -1;
 	} else {
-		fprintf(stderr, "mmap_alloc: check OK\n");
+		kadr[0] = 1;
+		kadr[info.size - 1] = 2;
+		if (kadr[0] != 1 || kadr[info.size - 1] != 2) {
+			fprintf(stderr, "mmap_alloc: split check ERROR\n");
+			ret = -1;
+		}
+		munmap(kadr + 2 * page, info.size - 2 * page);
+	}
+	munmap(kadr, page);
+	ioctl(fd, MMAP_ALLOC_IOC_FREE, &info.id);
+	if (!ret)
+		fprintf(stderr, "mmap_alloc: split check OK\n");
+	return ret;
+}
+
+static int check_huge(int fd, unsigned long len)
+{
+	struct mmap_alloc_buf info;
+	unsigned char *kadr;
+	unsigned long i;
+
+	memset(&info, 0, sizeof(info));
+	info.size = len;
+	info.flags = MMAP_ALLOC_F_HUGE;
+	if (ioctl(fd, MMAP_ALLOC_IOC_ALLOC, &info) < 0) {
+		perror("ioctl(ALLOC)");
+		return -1;
+	}
+	kadr = mmap(0, info.size, PROT_READ|PROT_WRITE, MAP_SHARED, fd,
+	    info.offset);
+	if (kadr == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	for (i = 0; i < info.size; i += getpagesize())
+		kadr[i] = 1;
+	if (ioctl(fd, MMAP_ALLOC_IOC_QUERY, &info) < 0) {
+		perror("ioctl(QUERY)");
+		return -1;
+	}
+	/* huge_maps may legitimately be 0 if THP is disabled */
+	fprintf(stderr, "mmap_alloc: huge buffer mapped with %llu PMDs and "
+	    "%llu PTEs\n", (unsigned long long)info.huge_maps,
+	    (unsigned long long)info.page_maps);
+	munmap(kadr, info.size);
+	ioctl(fd, MMAP_ALLOC_IOC_FREE, &info.id);
+	return 0;
+}
+
+/* map the ring of CPU 0 among the per-CPU ones and check it */
+static int check_percpu(int fd, unsigned long len)
+{
+	void *kadr;
+	int ret;
+
+	kadr = mmap(0, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd,
+	    MMAP_ALLOC_PERCPU_OFFSET);
+	if (kadr == MAP_FAILED) {
+		perror("mmap(PERCPU)");
+		return -1;
+	}
+	ret = check_ring(kadr, len);
+	munmap(kadr, len);
+	return ret;
+}
+
+/* export a cached buffer as a dma-buf, free it and use it through the
+ * dma-buf */
+static int check_export(int fd, unsigned long len)
+{
+	struct mmap_alloc_buf info;
+	struct mmap_alloc_export exp;
+	struct dma_buf_sync sync;
+	unsigned int *kadr;
+	unsigned long i;
+	int ret = 0;
+
+	memset(&info, 0, sizeof(info));
+	info.size = len;
+	info.flags = MMAP_ALLOC_F_CACHED;
+	if (ioctl(fd, MMAP_ALLOC_IOC_ALLOC, &info) < 0) {
+		perror("ioctl(ALLOC)");
+		return -1;
+	}
+	memset(&exp, 0, sizeof(exp));
+	exp.id = info.id;
+	exp.flags = O_CLOEXEC;
+	if (ioctl(fd, MMAP_ALLOC_IOC_EXPORT, &exp) < 0) {
+		perror("ioctl(EXPORT)");
+		return -1;
+	}
+	/* the dma-buf keeps the buffer alive */
+	if (ioctl(fd, MMAP_ALLOC_IOC_FREE, &info.id) < 0) {
+		perror("ioctl(FREE)");
+		ret = -1;
+	}
+
+	kadr = mmap(0, len, PROT_READ|PROT_WRITE, MAP_SHARED, exp.fd, 0);
+	if (kadr == MAP_FAILED) {
+		perror("mmap(dma-buf)");
+		close(exp.fd);
+		return -1;
+	}
+	sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW;
+	ioctl(exp.fd, DMA_BUF_IOCTL_SYNC, &sync);
+	for (i = 0; i < len / sizeof(int); i++)
+		kadr[i] = i;
+	for (i = 0; i < len / sizeof(int); i++)
+		if (kadr[i] != i)
+			break;
+	sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW;
+	ioctl(exp.fd, DMA_BUF_IOCTL_SYNC, &sync);
+	if (i != len / sizeof(int)) {
+		fprintf(stderr, "mmap_alloc: dma-buf check ERROR at %lu\n", i);
+		ret = -1;
+	} else {
+		fprintf(stderr, "mmap_alloc: dma-buf check OK\n");
+	}
+	munmap(kadr, len);
+	close(exp.fd);
+	return ret;
+}
+
+/* write a buffer with pwrite() and read it back with readv() */
+static int check_rw(int fd, unsigned long len)
+{
+	struct mmap_alloc_buf info;
+	struct iovec iov[2];
+	unsigned int *in, *out;
+	unsigned long i;
+	int ret = 0;
+
+	memset(&info, 0, sizeof(info));
+	info.size = len;
+	if (ioctl(fd, MMAP_ALLOC_IOC_ALLOC, &info) < 0) {
+		perror("ioctl(ALLOC)");
+		return -1;
+	}
+	in = malloc(len);
+	out = calloc(2, len);
+	for (i = 0; i < len / sizeof(int); i++)
+		in[i] = 0xcafe0000 + i;
+
+	if (pwrite(fd, in, len, info.offset) != (ssize_t)len) {
+		perror("pwrite");
+		ret = -1;
+		goto out;
+	}
+	/* SEEK_END is the end of the buffer */
+	if (lseek(fd, info.offset, SEEK_SET) < 0 ||
+	    lseek(fd, 0, SEEK_END) != (off_t)(info.offset + len) ||
+	    lseek(fd, info.offset, SEEK_SET) < 0) {
+		perror("lseek");
+		ret = -1;
+		goto out;
+	}
+	iov[0].iov_base = out;
+	iov[0].iov_len = len / 2;
+	iov[1].iov_base = (char *)out + len / 2;
+	iov[1].iov_len = len;	/* the read stops at the end of the buffer */
+	if (readv(fd, iov, 2) != (ssize_t)len || memcmp(in, out, len)) {
+		fprintf(stderr, "mmap_alloc: read/write check ERROR\n");
+		ret = -1;
+		goto out;
+	}
+	fprintf(stderr, "mmap_alloc: read/write check OK\n");
+  out:
+	ioctl(fd, MMAP_ALLOC_IOC_FREE, &info.id);
+	free(in);
+	free(out);
+	return ret;
+}
+
+/* write a buffer with pwrite() and splice it to a pipe */
+static int check_splice(int fd, unsigned long len)
+{
+	struct mmap_alloc_buf info;
+	unsigned int *in, *out;
+	loff_t off;
+	unsigned long i;
+	int p[2], ret = 0;
+
+	memset(&info, 0, sizeof(info));
+	info.size = len;
+	if (ioctl(fd, MMAP_ALLOC_IOC_ALLOC, &info) < 0) {
+		perror("ioctl(ALLOC)");
+		return -1;
+	}
+	if (pipe(p) < 0) {
+		perror("pipe");
+		ioctl(fd, MMAP_ALLOC_IOC_FREE, &info.id);
+		return -1;
+	}
+	in = malloc(len);
+	out = calloc(1, len);
+	for (i = 0; i < len / sizeof(int); i++)
+		in[i] = 0xf00d0000 + i;
+
+	off = info.offset;
+	if (pwrite(fd, in, len, info.offset) != (ssize_t)len ||
+	    splice(fd, &off, p[1], NULL, len, 0) != (ssize_t)len ||
+	    off != (loff_t)(info.offset + len)) {
+		perror("splice");
+		ret = -1;
+		goto out;
+	}
+	/* the pipe keeps the buffer alive */
+	ioctl(fd, MMAP_ALLOC_IOC_FREE, &info.id);
+	info.id = -1;
+	if (read(p[0], out, len) != (ssize_t)len || memcmp(in, out, len)) {
+		fprintf(stderr, "mmap_alloc: splice check ERROR\n");
+		ret = -1;
+		goto out;
+	}
+	fprintf(stderr, "mmap_alloc: splice check OK\n");
+  out:
+	if (info.id != (__u32)-1)
+		ioctl(fd, MMAP_ALLOC_IOC_FREE, &info.id);
+	close(p[0]);
+	close(p[1]);
+	free(in);
+	free(out);
+	return ret;
+}
+
+/* create a slab, empty it and recycle an object */
+static int check_slab(int fd, __u32 obj_size, __u32 count)
+{
+	struct mmap_alloc_slab_create req;
+	struct mmap_alloc_slab *s;
+	long long i, n;
+	int ret = 0;
+
+	memset(&req, 0, sizeof(req));
+	req.obj_size = obj_size;
+	req.count = count;
+	if (ioctl(fd, MMAP_ALLOC_IOC_SLAB_CREATE, &req) < 0) {
+		perror("ioctl(SLAB_CREATE)");
+		return -1;
+	}
+	s = mmap(0, req.size, PROT_READ|PROT_WRITE, MAP_SHARED, fd,
+	    req.offset);
+	if (s == MAP_FAILED) {
+		perror("mmap(slab)");
+		ioctl(fd, MMAP_ALLOC_IOC_FREE, &req.id);
+		return -1;
 	}
+	if (!mmap_alloc_slab_valid(s) || s->count != count)
+		ret = -1;
+	/* the objects come out in order, then the slab is empty */
+	for (n = 0; ret == 0 && n < count; n++) {
+		i = mmap_alloc_slab_get(s);
+		if (i != n)
+			ret = -1;
+		else
+			memset(mmap_alloc_slab_obj(s, i), 0xaa, obj_size);
+	}
+	if (ret == 0 && mmap_alloc_slab_get(s) != -1)
+		ret = -1;
+	if (ret == 0) {
+		mmap_alloc_slab_put(s, count / 2);
+		if (mmap_alloc_slab_get(s) != count / 2)
+			ret = -1;
+	}
+	fprintf(stderr, "mmap_alloc: slab check %s\n", ret ? "ERROR" : "OK");
+	munmap(s, req.size);
+	ioctl(fd, MMAP_ALLOC_IOC_FREE, &req.id);
+	return ret;
+}
+
+/*
+ * read the counts of buffers zeroed and reused with recycle_max, and the
+ * bytes kept
+ */
+static int read_recycle(unsigned long *zeroed, unsigned long *reused,
+    unsigned long *bytes)
+{
+	unsigned long ndirty, nready;
+	FILE *f;
+	int n;
+
+	if ((f = fopen(DEVICE_DIR "recycle", "r")) == NULL) {
+		perror(DEVICE_DIR "recycle");
+		return -1;
+	}
+	n = fscanf(f, "%lu %lu %lu %lu %lu", &ndirty, &nready, zeroed, reused,
+	    bytes);
+	fclose(f);
+	if (n != 5) {
+		fprintf(stderr, "mmap_alloc: cannot parse " DEVICE_DIR
+		    "recycle\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * dirty a buffer, free it and check that the next buffer of the same size
+ * is zeroed; with recycle_max, check that the freed one has been zeroed by
+ * the worker and then reused
+ */
+static int check_recycle(int fd, unsigned long len)
+{
+	unsigned long zeroed[2], reused[2], bytes;
+	struct mmap_alloc_buf info;
+	unsigned char *kadr;
+	unsigned long i;
+	int recycle, round, wait;
+
+	if (read_recycle(&zeroed[0], &reused[0], &bytes) < 0)
+		return -1;
+	/* the buffers freed before may have taken all the room */
+	recycle = bytes + len <= read_param("recycle_max");
+	for (round = 0; round < 2; round++) {
+		memset(&info, 0, sizeof(info));
+		info.size = len;
+		if (ioctl(fd, MMAP_ALLOC_IOC_ALLOC, &info) < 0) {
+			perror("ioctl(ALLOC)");
+			return -1;
+		}
+		kadr = mmap(0, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd,
+		    info.offset);
+		if (kadr == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+		for (i = 0; i < len; i++)
+			if (kadr[i])
+				break;
+		memset(kadr, 0xff, len);
+		munmap(kadr, len);
+		ioctl(fd, MMAP_ALLOC_IOC_FREE, &info.id);
+		if (i != len) {
+			fprintf(stderr, "mmap_alloc: recycle check ERROR\n");
+			return -1;
+		}
+		if (!recycle || round > 0)
+			continue;
+		/* wait up to a second for the worker to zero it */
+		for (wait = 0; wait < 100; wait++) {
+			if (read_recycle(&zeroed[1], &reused[1], &bytes) < 0)
+				return -1;
+			if (zeroed[1] > zeroed[0])
+				break;
+			usleep(10000);
+		}
+		if (zeroed[1] == zeroed[0]) {
+			fprintf(stderr, "mmap_alloc: recycle check ERROR "
+			    "(not zeroed)\n");
+			return -1;
+		}
+	}
+	if (recycle) {
+		if (read_recycle(&zeroed[1], &reused[1], &bytes) < 0)
+			return -1;
+		if (reused[1] == reused[0]) {
+			fprintf(stderr, "mmap_alloc: recycle check ERROR "
+			    "(not reused)\n");
+			return -1;
+		}
+	}
+	fprintf(stderr, "mmap_alloc: recycle check OK\n");
+	return 0;
+}
+
+/*
+ * check that poll() reports the publications of buffer 0, or only the
+ * records of its ring with ring_bufs=1
+ */
+static int check_poll(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	__u32 id = 0;
+	int ready[3];
+
+	if (ioctl(fd, MMAP_ALLOC_IOC_WATCH, &id) < 0) {
+		perror("ioctl(WATCH)");
+		return -1;
+	}
+	ready[0] = poll(&pfd, 1, 0);
+	if (ioctl(fd, MMAP_ALLOC_IOC_PUBLISH, &id) < 0) {
+		perror("ioctl(PUBLISH)");
+		return -1;
+	}
+	ready[1] = poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+	/* acknowledge */
+	if (ioctl(fd, MMAP_ALLOC_IOC_WATCH, &id) < 0) {
+		perror("ioctl(WATCH)");
+		return -1;
+	}
+	ready[2] = poll(&pfd, 1, 0);
+	if (ready[0] != 0 || ready[1] != !ring_bufs || ready[2] != 0) {
+		fprintf(stderr, "mmap_alloc: poll check ERROR (%d %d %d)\n",
+		    ready[0], ready[1], ready[2]);
+		return -1;
+	}
+	fprintf(stderr, "mmap_alloc: poll check OK\n");
+	return 0;
+}
+
+/*
+ * check that a doorbell on buffer 0 rings every second publication, then
+ * every 4 KiB declared by PUBLISH_DATA
+ */
+static int check_doorbell(int fd)
+{
+	struct mmap_alloc_doorbell db;
+	struct mmap_alloc_publish pub;
+	eventfd_t val;
+	__u32 id = 0;
+	int efd, rung[4], ret = 0;
+
+	if ((efd = eventfd(0, EFD_NONBLOCK)) < 0) {
+		perror("eventfd");
+		return -1;
+	}
+	memset(&db, 0, sizeof(db));
+	db.id = id;
+	db.fd = efd;
+	db.records = 2;
+	if (ioctl(fd, MMAP_ALLOC_IOC_DOORBELL, &db) < 0) {
+		perror("ioctl(DOORBELL)");
+		close(efd);
+		return -1;
+	}
+	ioctl(fd, MMAP_ALLOC_IOC_PUBLISH, &id);
+	rung[0] = eventfd_read(efd, &val) == 0;
+	ioctl(fd, MMAP_ALLOC_IOC_PUBLISH, &id);
+	rung[1] = eventfd_read(efd, &val) == 0;
+	/* then every 4 KiB published */
+	db.records = 0;
+	db.bytes = 4096;
+	if (ioctl(fd, MMAP_ALLOC_IOC_DOORBELL, &db) < 0) {
+		perror("ioctl(DOORBELL)");
+		close(efd);
+		return -1;
+	}
+	memset(&pub, 0, sizeof(pub));
+	pub.id = id;
+	pub.records = 1;
+	pub.bytes = 3000;
+	ioctl(fd, MMAP_ALLOC_IOC_PUBLISH_DATA, &pub);
+	rung[2] = eventfd_read(efd, &val) == 0;
+	ioctl(fd, MMAP_ALLOC_IOC_PUBLISH_DATA, &pub);
+	rung[3] = eventfd_read(efd, &val) == 0;
+	if (rung[0] || !rung[1] || rung[2] || !rung[3]) {
+		fprintf(stderr, "mmap_alloc: doorbell check ERROR "
+		    "(%d %d %d %d)\n", rung[0], rung[1], rung[2], rung[3]);
+		ret = -1;
+	} else {
+		fprintf(stderr, "mmap_alloc: doorbell check OK\n");
+	}
+	db.fd = -1;
+	if (ioctl(fd, MMAP_ALLOC_IOC_DOORBELL, &db) < 0) {
+		perror("ioctl(DOORBELL)");
+		ret = -1;
+	}
+	close(efd);
+	return ret;
+}
+
+int main(void)
+{
+	int fd;
+	unsigned int i;
+	int ret = 0;
+
+	unsigned int nbufs = read_param("nr_bufs");
+
+	ring_bufs = read_bool_param("ring_bufs");
+	pattern = read_bool_param("pattern");
+
+	if ((fd=open("/dev/mmap_alloc", O_RDWR|O_SYNC)) < 0) {
+		perror("open");
+		exit(-1);
+	}
+	fprintf(stderr, "mmap_alloc: open OK\n");
+
+	for (i = 0; i < nbufs; i++)
+		if (check_buffer(fd, i, MMAP_ALLOC_MODE(MMAP_ALLOC_MAP_DEFAULT)) < 0)
+			ret = -1;
+	if (check_alloc(fd, 3 * getpagesize(), 0, 0) < 0)
+		ret = -1;
+	if (check_alloc(fd, 5 * getpagesize(), MMAP_ALLOC_F_CACHED,
+	    MMAP_ALLOC_MAP_F_PREFAULT) < 0)
+		ret = -1;
+	if (check_alloc(fd, 4 * getpagesize(), MMAP_ALLOC_F_WC,
+	    MMAP_ALLOC_MODE(MMAP_ALLOC_MAP_WC)) < 0)
+		ret = -1;
+	/* the cached buffers never come from the coherent backend, which
+	 * cannot be mapped lazily */
+	if (check_alloc(fd, 3 * getpagesize(), MMAP_ALLOC_F_CACHED,
+	    MMAP_ALLOC_MAP_F_LAZY) < 0)
+		ret = -1;
+	/* node 0 always exists */
+	if (check_alloc(fd, 2 * getpagesize(), MMAP_ALLOC_F_NODE, 0) < 0)
+		ret = -1;
+	if (check_huge(fd, 4 << 20) < 0)
+		ret = -1;
+	if (check_private(fd, 2 * getpagesize()) < 0)
+		ret = -1;
+	if (check_split(fd, 4 * getpagesize()) < 0)
+		ret = -1;
+	if (read_param("pool_size") &&
+	    check_alloc(fd, 3 * getpagesize(), MMAP_ALLOC_F_POOL, 0) < 0)
+		ret = -1;
+	if (nbufs > 0 && check_poll(fd) < 0)
+		ret = -1;
+	if (nbufs > 0 && check_doorbell(fd) < 0)
+		ret = -1;
+	if (check_export(fd, 4 * getpagesize()) < 0)
+		ret = -1;
+	if (check_rw(fd, 3 * getpagesize()) < 0)
+		ret = -1;
+	if (check_slab(fd, 1000, 10) < 0)
+		ret = -1;
+	if (check_recycle(fd, 6 * getpagesize()) < 0)
+		ret = -1;
+	/* within the default capacity of a pipe */
+	if (check_splice(fd, 8 * getpagesize()) < 0)
+		ret = -1;
+	if (read_bool_param("percpu_bufs") &&
+	    check_percpu(fd, read_param("buf_size")) < 0)
+		ret = -1;
+
 	close(fd);
-	return(0);
+	return(ret);
 }
 
@@ -0,0 +1,164 @@
+/*
+ * Tracepoints of the mmap_alloc driver, in the mmap_alloc trace system:
+ *
+ *	perf trace -e 'mmap_alloc:*'
+ *	echo 1 > /sys/kernel/tracing/events/mmap_alloc/enable
+ *
+ * The driver is built with its own directory in the include path (see
+ * Kbuild) for define_trace.h to find this header.
+ *
+ * Authors: Claudio Scordino, Bruno Morelli
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mmap_alloc
+
+#if !defined(_MMAP_ALLOC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MMAP_ALLOC_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#ifndef _MMAP_ALLOC_TRACE_PATHS
+#define _MMAP_ALLOC_TRACE_PATHS
+/* how mmap_kmem() set up a mapping */
+enum mmap_alloc_path {
+	MMAP_PATH_FAULT,
+	MMAP_PATH_HUGE_FAULT,
+	MMAP_PATH_INSERT_PAGES,
+	MMAP_PATH_REMAP_PREFAULT,
+	MMAP_PATH_DMA_MMAP_COHERENT,
+	MMAP_PATH_REMAP,
+	MMAP_PATH_PERCPU,
+};
+#endif
+
+TRACE_DEFINE_ENUM(MMAP_PATH_FAULT);
+TRACE_DEFINE_ENUM(MMAP_PATH_HUGE_FAULT);
+TRACE_DEFINE_ENUM(MMAP_PATH_INSERT_PAGES);
+TRACE_DEFINE_ENUM(MMAP_PATH_REMAP_PREFAULT);
+TRACE_DEFINE_ENUM(MMAP_PATH_DMA_MMAP_COHERENT);
+TRACE_DEFINE_ENUM(MMAP_PATH_REMAP);
+TRACE_DEFINE_ENUM(MMAP_PATH_PERCPU);
+
+#define show_mmap_alloc_path(path)					\
+	__print_symbolic(path,						\
+		{ MMAP_PATH_FAULT,		"fault" },		\
+		{ MMAP_PATH_HUGE_FAULT,		"huge_fault" },		\
+		{ MMAP_PATH_INSERT_PAGES,	"vm_insert_pages" },	\
+		{ MMAP_PATH_REMAP_PREFAULT,	"remap_pfn_range_prefault" }, \
+		{ MMAP_PATH_DMA_MMAP_COHERENT,	"dma_mmap_coherent" },	\
+		{ MMAP_PATH_REMAP,		"remap_pfn_range" },	\
+		{ MMAP_PATH_PERCPU,		"percpu" })
+
+/* open() of the device, including the allocation of private buffers */
+TRACE_EVENT(mmap_alloc_open,
+	TP_PROTO(int ret, u64 ns),
+	TP_ARGS(ret, ns),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(int, ret)
+		__field(u64, ns)
+	),
+
+	TP_fast_assign(
+		__entry->pid = current->pid;
+		__entry->ret = ret;
+		__entry->ns = ns;
+	),
+
+	TP_printk("pid=%d ret=%d ns=%llu", __entry->pid, __entry->ret,
+		  __entry->ns)
+);
+
+/* last close of the device, including the release of its buffers */
+TRACE_EVENT(mmap_alloc_release,
+	TP_PROTO(u64 ns),
+	TP_ARGS(ns),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(u64, ns)
+	),
+
+	TP_fast_assign(
+		__entry->pid = current->pid;
+		__entry->ns = ns;
+	),
+
+	TP_printk("pid=%d ns=%llu", __entry->pid, __entry->ns)
+);
+
+/* mmap() of a buffer: the time spent populating the mapping, if any */
+TRACE_EVENT(mmap_alloc_mmap,
+	TP_PROTO(unsigned long id, unsigned long offset, unsigned long length,
+		 unsigned long mode, enum mmap_alloc_path path, int ret,
+		 u64 ns),
+	TP_ARGS(id, offset, length, mode, path, ret, ns),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(unsigned long, id)
+		__field(unsigned long, offset)
+		__field(unsigned long, length)
+		__field(unsigned long, mode)
+		__field(int, path)
+		__field(int, ret)
+		__field(u64, ns)
+	),
+
+	TP_fast_assign(
+		__entry->pid = current->pid;
+		__entry->id = id;
+		__entry->offset = offset;
+		__entry->length = length;
+		__entry->mode = mode;
+		__entry->path = path;
+		__entry->ret = ret;
+		__entry->ns = ns;
+	),
+
+	TP_printk("pid=%d id=%lu offset=0x%lx length=%lu mode=%lu path=%s "
+		  "ret=%d ns=%llu", __entry->pid, __entry->id, __entry->offset,
+		  __entry->length, __entry->mode,
+		  show_mmap_alloc_path(__entry->path), __entry->ret,
+		  __entry->ns)
+);
+
+/* fault on a mapping populated at fault time */
+TRACE_EVENT(mmap_alloc_fault,
+	TP_PROTO(unsigned long address, unsigned long pgoff,
+		 unsigned int order, unsigned int ret, u64 ns),
+	TP_ARGS(address, pgoff, order, ret, ns),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(unsigned long, address)
+		__field(unsigned long, pgoff)
+		__field(unsigned int, order)
+		__field(unsigned int, ret)
+		__field(u64, ns)
+	),
+
+	TP_fast_assign(
+		__entry->pid = current->pid;
+		__entry->address = address;
+		__entry->pgoff = pgoff;
+		__entry->order = order;
+		__entry->ret = ret;
+		__entry->ns = ns;
+	),
+
+	TP_printk("pid=%d address=0x%lx pgoff=0x%lx order=%u ret=0x%x ns=%llu",
+		  __entry->pid, __entry->address, __entry->pgoff,
+		  __entry->order, __entry->ret, __entry->ns)
+);
+
+#endif /* _MMAP_ALLOC_TRACE_H */
+
+/* this part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mmap_alloc_trace
+#include <trace/define_trace.h>